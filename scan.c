@@ -25,6 +25,342 @@
 #include "mesh.h"
 
 
+#ifdef CONFIG_SCAN_ALLOC_TRACE
+
+/*
+ * Scan path allocation tracer
+ *
+ * All os_*() and wpabuf allocations in this file are counted per call site
+ * (function and line) and summarized per scan cycle, i.e., between two
+ * processed sets of new scan results: number of allocations, bytes allocated,
+ * the peak of the bytes held by live allocations from this file and the bytes
+ * still held at the end of the cycle (retained). Only frees in this file are
+ * seen, so the live allocations are forgotten at the end of each cycle: memory
+ * handed over to and freed by other modules then does not stay accounted as
+ * live. Memory allocated elsewhere and freed here is ignored.
+ *
+ * The tracer uses only static storage, so it does not allocate itself. The
+ * state is global rather than per interface since many of the traced helpers
+ * have no interface context; with several interfaces, their scan cycles are
+ * combined.
+ */
+#define WPAS_ALLOC_TRACE_SITES 64
+/* Size of the live allocation hash table (power of two) */
+#define WPAS_ALLOC_TRACE_LIVE 512
+
+struct wpas_alloc_site {
+	const char *func;
+	int line;
+	unsigned int count;
+	unsigned int cycle_count;
+	unsigned int last_count;
+	size_t bytes;
+};
+
+struct wpas_alloc_cycle {
+	unsigned int count;
+	size_t bytes;
+	size_t peak;
+	size_t retained;
+};
+
+static struct {
+	struct wpas_alloc_site site[WPAS_ALLOC_TRACE_SITES];
+	unsigned int num_sites;
+	struct {
+		const void *ptr;
+		size_t len;
+	} live[WPAS_ALLOC_TRACE_LIVE];
+	unsigned int num_live;
+	size_t live_bytes;
+	unsigned int untracked;
+	struct wpas_alloc_cycle cur, last;
+	unsigned int cycles;
+} wpas_alloc_trace;
+
+
+static unsigned int wpas_alloc_trace_hash(const void *ptr)
+{
+	u32 val = (u32) ((unsigned long) ptr >> 3);
+
+	return (val * 2654435761U >> 16) & (WPAS_ALLOC_TRACE_LIVE - 1);
+}
+
+
+static void wpas_alloc_trace_add(const void *ptr, size_t len,
+				 const char *func, int line)
+{
+	struct wpas_alloc_site *site = NULL;
+	unsigned int i;
+
+	if (!ptr)
+		return;
+
+	for (i = 0; i < wpas_alloc_trace.num_sites; i++) {
+		if (wpas_alloc_trace.site[i].func == func &&
+		    wpas_alloc_trace.site[i].line == line) {
+			site = &wpas_alloc_trace.site[i];
+			break;
+		}
+	}
+	if (!site && wpas_alloc_trace.num_sites < WPAS_ALLOC_TRACE_SITES) {
+		site = &wpas_alloc_trace.site[wpas_alloc_trace.num_sites++];
+		site->func = func;
+		site->line = line;
+	}
+	if (site) {
+		site->count++;
+		site->cycle_count++;
+		site->bytes += len;
+	}
+
+	wpas_alloc_trace.cur.count++;
+	wpas_alloc_trace.cur.bytes += len;
+
+	/* Keep the load factor at 3/4 so that probe sequences stay short */
+	if (wpas_alloc_trace.num_live >= WPAS_ALLOC_TRACE_LIVE / 4 * 3) {
+		wpas_alloc_trace.untracked++;
+		return;
+	}
+	i = wpas_alloc_trace_hash(ptr);
+	while (wpas_alloc_trace.live[i].ptr)
+		i = (i + 1) & (WPAS_ALLOC_TRACE_LIVE - 1);
+	wpas_alloc_trace.live[i].ptr = ptr;
+	wpas_alloc_trace.live[i].len = len;
+	wpas_alloc_trace.num_live++;
+	wpas_alloc_trace.live_bytes += len;
+	if (wpas_alloc_trace.live_bytes > wpas_alloc_trace.cur.peak)
+		wpas_alloc_trace.cur.peak = wpas_alloc_trace.live_bytes;
+}
+
+
+static void wpas_alloc_trace_del(const void *ptr)
+{
+	const unsigned int mask = WPAS_ALLOC_TRACE_LIVE - 1;
+	unsigned int i, j, h;
+
+	if (!ptr)
+		return;
+	for (i = wpas_alloc_trace_hash(ptr); wpas_alloc_trace.live[i].ptr;
+	     i = (i + 1) & mask) {
+		if (wpas_alloc_trace.live[i].ptr == ptr)
+			break;
+	}
+	if (!wpas_alloc_trace.live[i].ptr)
+		return; /* not allocated here or forgotten at a cycle end */
+
+	wpas_alloc_trace.live_bytes -= wpas_alloc_trace.live[i].len;
+	wpas_alloc_trace.num_live--;
+
+	/* Move following entries of the probe sequence into the gap */
+	for (j = (i + 1) & mask; wpas_alloc_trace.live[j].ptr;
+	     j = (j + 1) & mask) {
+		h = wpas_alloc_trace_hash(wpas_alloc_trace.live[j].ptr);
+		if (((j - h) & mask) >= ((j - i) & mask)) {
+			wpas_alloc_trace.live[i] = wpas_alloc_trace.live[j];
+			i = j;
+		}
+	}
+	wpas_alloc_trace.live[i].ptr = NULL;
+}
+
+
+static void * wpas_trace_malloc(size_t size, const char *func, int line)
+{
+	void *ptr = os_malloc(size);
+
+	wpas_alloc_trace_add(ptr, size, func, line);
+	return ptr;
+}
+
+
+static void * wpas_trace_zalloc(size_t size, const char *func, int line)
+{
+	void *ptr = os_zalloc(size);
+
+	wpas_alloc_trace_add(ptr, size, func, line);
+	return ptr;
+}
+
+
+static void * wpas_trace_calloc(size_t nmemb, size_t size, const char *func,
+				int line)
+{
+	void *ptr = os_calloc(nmemb, size);
+
+	wpas_alloc_trace_add(ptr, nmemb * size, func, line);
+	return ptr;
+}
+
+
+static void * wpas_trace_realloc_array(void *ptr, size_t nmemb, size_t size,
+				       const char *func, int line)
+{
+	void *n = os_realloc_array(ptr, nmemb, size);
+
+	if (n) {
+		wpas_alloc_trace_del(ptr);
+		wpas_alloc_trace_add(n, nmemb * size, func, line);
+	}
+	return n;
+}
+
+
+static void * wpas_trace_memdup(const void *src, size_t len, const char *func,
+				int line)
+{
+	void *ptr = os_memdup(src, len);
+
+	wpas_alloc_trace_add(ptr, len, func, line);
+	return ptr;
+}
+
+
+static void wpas_trace_free(void *ptr)
+{
+	wpas_alloc_trace_del(ptr);
+	os_free(ptr);
+}
+
+
+static struct wpabuf * wpas_trace_wpabuf_alloc(size_t len, const char *func,
+					       int line)
+{
+	struct wpabuf *buf = wpabuf_alloc(len);
+
+	wpas_alloc_trace_add(buf, sizeof(*buf) + len, func, line);
+	return buf;
+}
+
+
+static int wpas_trace_wpabuf_resize(struct wpabuf **buf, size_t add_len,
+				    const char *func, int line)
+{
+	struct wpabuf *old = *buf;
+	size_t old_size = old ? wpabuf_size(old) : 0;
+	int ret;
+
+	ret = wpabuf_resize(buf, add_len);
+	if (ret == 0 && (*buf != old || wpabuf_size(*buf) != old_size)) {
+		wpas_alloc_trace_del(old);
+		wpas_alloc_trace_add(*buf, sizeof(**buf) + wpabuf_size(*buf),
+				     func, line);
+	}
+	return ret;
+}
+
+
+static void wpas_trace_wpabuf_free(struct wpabuf *buf)
+{
+	wpas_alloc_trace_del(buf);
+	wpabuf_free(buf);
+}
+
+
+/* Close a scan cycle and log its allocation summary */
+static void wpas_alloc_trace_cycle_end(struct wpa_supplicant *wpa_s)
+{
+	unsigned int i;
+
+	wpas_alloc_trace.cur.retained = wpas_alloc_trace.live_bytes;
+	wpas_alloc_trace.last = wpas_alloc_trace.cur;
+	wpas_alloc_trace.cycles++;
+	wpa_dbg(wpa_s, MSG_DEBUG,
+		"Scan cycle %u allocations: count=%u bytes=%u peak=%u retained=%u",
+		wpas_alloc_trace.cycles, wpas_alloc_trace.last.count,
+		(unsigned int) wpas_alloc_trace.last.bytes,
+		(unsigned int) wpas_alloc_trace.last.peak,
+		(unsigned int) wpas_alloc_trace.last.retained);
+
+	for (i = 0; i < wpas_alloc_trace.num_sites; i++) {
+		struct wpas_alloc_site *site = &wpas_alloc_trace.site[i];
+
+		site->last_count = site->cycle_count;
+		site->cycle_count = 0;
+		if (site->last_count)
+			wpa_printf(MSG_EXCESSIVE, "  %s:%d count=%u",
+				   site->func, site->line, site->last_count);
+	}
+
+	os_memset(&wpas_alloc_trace.cur, 0, sizeof(wpas_alloc_trace.cur));
+	os_memset(wpas_alloc_trace.live, 0, sizeof(wpas_alloc_trace.live));
+	wpas_alloc_trace.num_live = 0;
+	wpas_alloc_trace.live_bytes = 0;
+}
+
+
+/**
+ * wpas_scan_alloc_trace - Write scan path allocation statistics
+ * @wpa_s: Pointer to wpa_supplicant data
+ * @buf: Buffer for the text output
+ * @buflen: Length of the buffer
+ * Returns: Number of bytes written to the buffer or -1 on failure
+ *
+ * This function is used by the control interface to report the allocation
+ * summary of the last completed scan cycle and the allocations of each call
+ * site in that cycle and in total.
+ */
+int wpas_scan_alloc_trace(struct wpa_supplicant *wpa_s, char *buf,
+			  size_t buflen)
+{
+	char *pos = buf, *end = buf + buflen;
+	unsigned int i;
+	int ret;
+
+	ret = os_snprintf(pos, end - pos,
+			  "cycles=%u\ncount=%u\nbytes=%u\npeak=%u\nretained=%u\n"
+			  "untracked=%u\n",
+			  wpas_alloc_trace.cycles, wpas_alloc_trace.last.count,
+			  (unsigned int) wpas_alloc_trace.last.bytes,
+			  (unsigned int) wpas_alloc_trace.last.peak,
+			  (unsigned int) wpas_alloc_trace.last.retained,
+			  wpas_alloc_trace.untracked);
+	if (os_snprintf_error(end - pos, ret))
+		return -1;
+	pos += ret;
+
+	for (i = 0; i < wpas_alloc_trace.num_sites; i++) {
+		struct wpas_alloc_site *site = &wpas_alloc_trace.site[i];
+
+		ret = os_snprintf(pos, end - pos,
+				  "site=%s:%d last=%u total=%u bytes=%u\n",
+				  site->func, site->line, site->last_count,
+				  site->count, (unsigned int) site->bytes);
+		if (os_snprintf_error(end - pos, ret))
+			break;
+		pos += ret;
+	}
+
+	return pos - buf;
+}
+
+#undef os_malloc
+#undef os_zalloc
+#undef os_calloc
+#undef os_realloc_array
+#undef os_memdup
+#undef os_free
+#define os_malloc(s) wpas_trace_malloc((s), __func__, __LINE__)
+#define os_zalloc(s) wpas_trace_zalloc((s), __func__, __LINE__)
+#define os_calloc(n, s) wpas_trace_calloc((n), (s), __func__, __LINE__)
+#define os_realloc_array(p, n, s) \
+	wpas_trace_realloc_array((p), (n), (s), __func__, __LINE__)
+#define os_memdup(p, l) wpas_trace_memdup((p), (l), __func__, __LINE__)
+#define os_free(p) wpas_trace_free((p))
+#define wpabuf_alloc(l) wpas_trace_wpabuf_alloc((l), __func__, __LINE__)
+#define wpabuf_resize(b, l) \
+	wpas_trace_wpabuf_resize((b), (l), __func__, __LINE__)
+#define wpabuf_free(b) wpas_trace_wpabuf_free((b))
+
+#else /* CONFIG_SCAN_ALLOC_TRACE */
+
+static inline void wpas_alloc_trace_cycle_end(struct wpa_supplicant *wpa_s)
+{
+}
+
+#endif /* CONFIG_SCAN_ALLOC_TRACE */
+
+
 static void wpa_supplicant_gen_assoc_event(struct wpa_supplicant *wpa_s)
 {
 	struct wpa_ssid *ssid;
@@ -166,39 +502,369 @@ static void wpa_supplicant_assoc_try(struct wpa_supplicant *wpa_s,
 	wpa_supplicant_associate(wpa_s, NULL, ssid);
 }
 
-//追加
-// scan.c
-static void scan_for_owe_and_non_ascii(struct wpa_supplicant *wpa_s) {
-    struct wpa_ssid *ssid;
-    dl_list_for_each(ssid, &wpa_s->conf->ssid, struct wpa_ssid, list) {
-        if (ssid->hidden && (is_owe_ssid(ssid) || is_non_ascii_ssid(ssid))) {
-            // 非同期スキャンを実行（CPU負荷軽減）
-            os_thread_create("owe_scan", scan_single_owe_ssid, ssid);
-        }
-    }
+/*
+ * Scan pipeline latency statistics
+ *
+ * The time each scan spends in the stages below is collected into per-stage
+ * histograms with power-of-two millisecond buckets: bucket 0 counts durations
+ * below 1 ms, bucket i durations in [2^(i-1), 2^i) ms and the last bucket
+ * everything longer. The statistics are reported and reset through the
+ * control interface (SCAN_STATS). Queued scan work items are timed separately
+ * (keyed by their scan parameters); only one scan work runs at a time, so the
+ * later stages are timed for the work recorded in stats->work. The process
+ * stage ends with the BSS table update; the bookkeeping done after it is not
+ * part of any stage. The decide stage ends when the scan result processing
+ * schedules the next scan or cancels scanning to connect; requests that do
+ * not change when the next scan starts and trigger failure retries do not end
+ * it.
+ */
+enum wpas_scan_stage {
+	WPAS_SCAN_STAGE_QUEUE, /* scan request -> radio work started */
+	WPAS_SCAN_STAGE_TRIGGER, /* radio work started -> driver accepted */
+	WPAS_SCAN_STAGE_SCAN, /* driver accepted -> scan results fetched */
+	WPAS_SCAN_STAGE_PROCESS, /* fetch -> results sorted, BSS table updated */
+	WPAS_SCAN_STAGE_DECIDE, /* scan done -> connection decision */
+	WPAS_SCAN_STAGES
+};
+
+#define WPAS_SCAN_STATS_BUCKETS 18
+/* Maximum number of queued scan work items timed at the same time */
+#define WPAS_SCAN_STATS_QUEUED 4
+
+static const char * const wpas_scan_stage_name[WPAS_SCAN_STAGES] = {
+	"queue", "trigger", "scan", "process", "decide"
+};
+
+struct wpas_scan_stage_stats {
+	unsigned int count;
+	unsigned int max_ms;
+	u64 total_ms;
+	unsigned int hist[WPAS_SCAN_STATS_BUCKETS];
+};
+
+struct wpas_scan_stats_queued {
+	const struct wpa_driver_scan_params *params; /* ctx of the work */
+	struct os_reltime request;
+};
+
+struct wpas_scan_stats {
+	struct wpas_scan_stage_stats stage[WPAS_SCAN_STAGES];
+	struct wpas_scan_stats_queued queued[WPAS_SCAN_STATS_QUEUED];
+	/* Scan work in the trigger and scan stages */
+	const struct wpa_radio_work *work;
+	/* Start of the stage in progress (zero when not in progress) */
+	struct os_reltime work_start;
+	struct os_reltime trigger;
+	struct os_reltime done;
+	struct os_reltime since;
+};
+
+
+static struct wpas_scan_stats *
+wpas_scan_stats_get(struct wpa_supplicant *wpa_s)
+{
+	if (!wpa_s->scan_stats) {
+		wpa_s->scan_stats = os_zalloc(sizeof(*wpa_s->scan_stats));
+		if (wpa_s->scan_stats)
+			os_get_reltime(&wpa_s->scan_stats->since);
+	}
+	return wpa_s->scan_stats;
+}
+
+
+/* Account the time since @start to a stage and clear @start */
+static void wpas_scan_stats_end(struct wpas_scan_stats *stats,
+				enum wpas_scan_stage stage,
+				struct os_reltime *start)
+{
+	struct wpas_scan_stage_stats *s = &stats->stage[stage];
+	struct os_reltime now, diff;
+	unsigned int ms, bucket = 0;
+
+	if (!os_reltime_initialized(start))
+		return;
+	os_get_reltime(&now);
+	os_reltime_sub(&now, start, &diff);
+	os_memset(start, 0, sizeof(*start));
+	if (diff.sec < 0)
+		return;
+
+	ms = diff.sec * 1000 + diff.usec / 1000;
+	while (bucket < WPAS_SCAN_STATS_BUCKETS - 1 && ms >= (1U << bucket))
+		bucket++;
+
+	s->count++;
+	s->total_ms += ms;
+	if (ms > s->max_ms)
+		s->max_ms = ms;
+	s->hist[bucket]++;
+}
+
+
+/* Find the queue entry of a scan work item by its parameters */
+static struct wpas_scan_stats_queued *
+wpas_scan_stats_queued_get(struct wpas_scan_stats *stats,
+			   const struct wpa_driver_scan_params *params)
+{
+	unsigned int i;
+
+	for (i = 0; i < WPAS_SCAN_STATS_QUEUED; i++) {
+		if (stats->queued[i].params == params)
+			return &stats->queued[i];
+	}
+	return NULL;
+}
+
+
+/* Note that a scan has been handled by a new scan or a connection attempt */
+static void wpas_scan_stats_decided(struct wpa_supplicant *wpa_s)
+{
+	if (wpa_s->scan_stats)
+		wpas_scan_stats_end(wpa_s->scan_stats, WPAS_SCAN_STAGE_DECIDE,
+				    &wpa_s->scan_stats->done);
+}
+
+
+static void wpas_req_scan(struct wpa_supplicant *wpa_s, int sec, int usec,
+			  int decision);
+
+
+/* Delay limits for retrying a failed scan trigger (in milliseconds) */
+#define SCAN_RETRY_MIN_MS 1000
+#define SCAN_RETRY_MAX_MS 60000
+
+/*
+ * Schedule a new scan after a failed scan trigger. The base delay starts at
+ * SCAN_RETRY_MIN_MS and doubles with each consecutive failure, and the retry
+ * comes after a random delay in [base, 2 * base), at most SCAN_RETRY_MAX_MS,
+ * so that a busy or hung driver is not polled every second and interfaces or
+ * devices that failed at the same time do not retry in lockstep.
+ */
+static void wpa_supplicant_req_scan_retry(struct wpa_supplicant *wpa_s)
+{
+	unsigned int base, delay, jitter;
+
+	if (wpa_s->scan_trigger_failures >= 16)
+		base = SCAN_RETRY_MAX_MS / 2;
+	else
+		base = SCAN_RETRY_MIN_MS << wpa_s->scan_trigger_failures;
+	if (base > SCAN_RETRY_MAX_MS / 2)
+		base = SCAN_RETRY_MAX_MS / 2;
+	if (os_get_random((u8 *) &jitter, sizeof(jitter)) < 0)
+		jitter = os_random();
+	delay = base + jitter % base;
+
+	wpa_s->scan_trigger_failures++;
+	wpa_s->scan_retries++;
+	wpa_s->scan_retry_last_delay = delay;
+	wpa_dbg(wpa_s, MSG_DEBUG,
+		"Retry scan in %u ms (consecutive failures: %u)",
+		delay, wpa_s->scan_trigger_failures);
+	/* Not a decision on scan results, so do not end the decide stage */
+	wpas_req_scan(wpa_s, delay / 1000, (delay % 1000) * 1000, 0);
+}
+
+
+/*
+ * Result handlers of merged scan requests
+ *
+ * Requesters that need the results of their scan set wpa_s->scan_res_handler
+ * before calling wpa_supplicant_trigger_scan(). When such a request is merged
+ * into a queued scan work item that was requested with another handler, both
+ * handlers are recorded here and wpas_scan_merged_res_handler() is installed
+ * to run them all on the results of the shared scan. The list moves from
+ * pending to active when the work item starts, so that requests queued during
+ * a running scan do not get mixed into it.
+ */
+#define WPAS_SCAN_MERGE_MAX_HANDLERS 4
+
+typedef void (*wpas_scan_res_handler)(struct wpa_supplicant *wpa_s,
+				      struct wpa_scan_results *scan_res);
+
+struct wpas_scan_merge {
+	wpas_scan_res_handler pending[WPAS_SCAN_MERGE_MAX_HANDLERS];
+	size_t num_pending;
+	wpas_scan_res_handler active[WPAS_SCAN_MERGE_MAX_HANDLERS];
+	size_t num_active;
+	/* wpa_s->scan_res_handler as left by the last accepted request */
+	wpas_scan_res_handler installed;
+};
+
+
+static void wpas_scan_merged_res_handler(struct wpa_supplicant *wpa_s,
+					 struct wpa_scan_results *scan_res)
+{
+	struct wpas_scan_merge *merge = wpa_s->scan_merge;
+	wpas_scan_res_handler handler[WPAS_SCAN_MERGE_MAX_HANDLERS];
+	size_t i, num;
+
+	if (!merge)
+		return;
+
+	/* Handlers may trigger new scans, so work on a copy of the list */
+	num = merge->num_active;
+	os_memcpy(handler, merge->active, num * sizeof(handler[0]));
+	merge->num_active = 0;
+
+	wpa_dbg(wpa_s, MSG_DEBUG,
+		"Deliver scan results to %u merged requesters",
+		(unsigned int) num);
+	for (i = 0; i < num; i++)
+		handler[i](wpa_s, scan_res);
+}
+
+
+/* The result handler the caller of wpa_supplicant_trigger_scan() asked for */
+static wpas_scan_res_handler wpas_scan_req_handler(struct wpa_supplicant *wpa_s)
+{
+	/* A leftover dispatcher belongs to an earlier scan */
+	if (wpa_s->scan_res_handler == wpas_scan_merged_res_handler)
+		return NULL;
+	return wpa_s->scan_res_handler;
+}
+
+
+/* Record the handler of the first request of a new scan work item */
+static void wpas_scan_merge_first(struct wpa_supplicant *wpa_s)
+{
+	struct wpas_scan_merge *merge = wpa_s->scan_merge;
+
+	if (!merge) {
+		merge = os_zalloc(sizeof(*merge));
+		if (!merge)
+			return;
+		wpa_s->scan_merge = merge;
+	}
+
+	merge->pending[0] = wpas_scan_req_handler(wpa_s);
+	merge->num_pending = 1;
+	merge->installed = wpa_s->scan_res_handler;
+}
+
+
+/*
+ * Check whether the result handler of a new request can share the pending
+ * scan work item and, if @add is set, record it. Returns 0 on success or -1
+ * if the request cannot be merged.
+ */
+static int wpas_scan_merge_handler(struct wpa_supplicant *wpa_s, int add)
+{
+	struct wpas_scan_merge *merge = wpa_s->scan_merge;
+	wpas_scan_res_handler handler;
+	size_t i;
+
+	if (!merge || !merge->num_pending)
+		return -1;
+
+	/* An unchanged handler means the request did not ask for its own */
+	if (wpa_s->scan_res_handler == merge->installed)
+		return 0;
+	handler = wpas_scan_req_handler(wpa_s);
+
+	for (i = 0; i < merge->num_pending; i++) {
+		if (merge->pending[i] == handler)
+			return 0;
+		/*
+		 * Normal result processing in events.c runs only without a
+		 * handler and cannot be combined with one.
+		 */
+		if (!merge->pending[i] || !handler) {
+			wpa_dbg(wpa_s, MSG_DEBUG,
+				"Cannot merge scan request: normal and handled results");
+			return -1;
+		}
+	}
+	if (merge->num_pending == WPAS_SCAN_MERGE_MAX_HANDLERS) {
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"Cannot merge scan request: too many result handlers");
+		return -1;
+	}
+	if (!add)
+		return 0;
+
+	merge->pending[merge->num_pending++] = handler;
+	wpa_s->scan_res_handler = wpas_scan_merged_res_handler;
+	merge->installed = wpa_s->scan_res_handler;
+	return 0;
 }
 
-// 個別SSIDのスキャン関数（非同期処理）
-static void* scan_single_owe_ssid(void* data) {
-    struct wpa_ssid *ssid = (struct wpa_ssid*)data;
-    wpa_supplicant_trigger_scan(wpa_s, ssid);
-    return NULL;
+
+/* The pending scan work item is starting, so its handler list is final */
+static void wpas_scan_merge_start(struct wpa_supplicant *wpa_s)
+{
+	struct wpas_scan_merge *merge = wpa_s->scan_merge;
+
+	if (!merge)
+		return;
+	os_memcpy(merge->active, merge->pending, sizeof(merge->active));
+	merge->num_active = merge->num_pending;
+	merge->num_pending = 0;
 }
-// スキャンキャッシュをステール時にクリア
-void wpas_clear_scan_cache_if_stale(struct wpa_supplicant *wpa_s) {
-    if (time_before(wpa_s->last_scan_time + kMaxCacheAge, os_time_get())) {
-        wpa_supplicant_clear_status(wpa_s);  // キャッシュをリセット
-    }
+
+
+/* Undo the dispatcher of a merged scan that will not deliver results */
+static void wpas_scan_merge_failed(struct wpa_supplicant *wpa_s)
+{
+	struct wpas_scan_merge *merge = wpa_s->scan_merge;
+
+	if (!merge)
+		return;
+	merge->num_active = 0;
+	if (wpa_s->scan_res_handler == wpas_scan_merged_res_handler)
+		wpa_s->scan_res_handler = NULL;
 }
-//ここまで
+
+
+static void wpas_chan_stats_triggered(
+	struct wpa_supplicant *wpa_s,
+	const struct wpa_driver_scan_params *params);
+struct wpas_network_set;
+static void wpas_chan_stats_results(struct wpa_supplicant *wpa_s,
+				    const struct wpas_network_set *networks,
+				    struct wpa_scan_results *scan_res);
+static void wpas_scan_chunks_free(struct wpa_supplicant *wpa_s);
+
 
 static void wpas_trigger_scan_cb(struct wpa_radio_work *work, int deinit)
 {
 	struct wpa_supplicant *wpa_s = work->wpa_s;
 	struct wpa_driver_scan_params *params = work->ctx;
+	struct wpas_scan_stats *stats;
+	struct wpas_scan_stats_queued *queued;
 	int ret;
 
+	if (params && params == wpa_s->pending_scan_params) {
+		wpa_s->pending_scan_params = NULL; /* no more merging */
+		if (!deinit)
+			wpas_scan_merge_start(wpa_s);
+		else if (wpa_s->scan_merge) {
+			wpa_s->scan_merge->num_pending = 0;
+			if (!wpa_s->scan_merge->num_active)
+				wpas_scan_merge_failed(wpa_s);
+		}
+	}
+
+	stats = wpas_scan_stats_get(wpa_s);
+	queued = stats && params ? wpas_scan_stats_queued_get(stats, params) :
+		NULL;
+
+	if (params && params == wpa_s->scan_chunk_req) {
+		wpa_s->scan_chunk_req = NULL;
+		if (!deinit)
+			wpa_s->scan_chunk_work = work;
+		else
+			wpas_scan_chunks_free(wpa_s);
+	} else if (deinit && work == wpa_s->scan_chunk_work) {
+		wpas_scan_chunks_free(wpa_s);
+	}
+
 	if (deinit) {
+		if (queued)
+			os_memset(queued, 0, sizeof(*queued));
+		if (stats && stats->work == work) {
+			stats->work = NULL;
+			os_memset(&stats->trigger, 0, sizeof(stats->trigger));
+		}
 		if (!work->started) {
 			wpa_scan_free_params(params);
 			return;
@@ -209,6 +875,16 @@ static void wpas_trigger_scan_cb(struct wpa_radio_work *work, int deinit)
 		return;
 	}
 
+	if (queued) {
+		wpas_scan_stats_end(stats, WPAS_SCAN_STAGE_QUEUE,
+				    &queued->request);
+		queued->params = NULL;
+	}
+	if (stats) {
+		stats->work = work;
+		os_get_reltime(&stats->work_start);
+	}
+
 	if (wpas_update_random_addr_disassoc(wpa_s) < 0) {
 		wpa_msg(wpa_s, MSG_INFO,
 			"Failed to assign random MAC address for a scan");
@@ -229,6 +905,8 @@ static void wpas_trigger_scan_cb(struct wpa_radio_work *work, int deinit)
 		wpa_setup_mac_addr_rand_params(params, wpa_s->mac_addr_scan);
 
 	ret = wpa_drv_scan(wpa_s, params);
+	if (ret == 0)
+		wpas_chan_stats_triggered(wpa_s, params);
 	wpa_scan_free_params(params);
 	work->ctx = NULL;
 	if (ret) {
@@ -244,17 +922,34 @@ static void wpas_trigger_scan_cb(struct wpa_radio_work *work, int deinit)
 						 wpa_s->scan_prev_wpa_state);
 		wpa_msg(wpa_s, MSG_INFO, WPA_EVENT_SCAN_FAILED "ret=%d%s",
 			ret, retry ? " retry=1" : "");
+		wpas_scan_merge_failed(wpa_s);
+		if (stats)
+			stats->work = NULL;
+		if (work == wpa_s->scan_chunk_work)
+			wpas_scan_chunks_free(wpa_s);
 		radio_work_done(work);
 
 		if (retry) {
 			/* Restore scan_req since we will try to scan again */
 			wpa_s->scan_req = wpa_s->last_scan_req;
-			wpa_supplicant_req_scan(wpa_s, 1, 0);
+			wpa_supplicant_req_scan_retry(wpa_s);
 		}
 		return;
 	}
 
+	if (wpa_s->scan_trigger_failures) {
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"Scan trigger succeeded after %u failure(s)",
+			wpa_s->scan_trigger_failures);
+		wpa_s->scan_trigger_failures = 0;
+	}
+
 	os_get_reltime(&wpa_s->scan_trigger_time);
+	if (stats) {
+		wpas_scan_stats_end(stats, WPAS_SCAN_STAGE_TRIGGER,
+				    &stats->work_start);
+		stats->trigger = wpa_s->scan_trigger_time;
+	}
 	wpa_s->scan_runs++;
 	wpa_s->normal_scans++;
 	wpa_s->own_scan_requested = 1;
@@ -263,33 +958,383 @@ static void wpas_trigger_scan_cb(struct wpa_radio_work *work, int deinit)
 }
 
 
-/**
- * wpa_supplicant_trigger_scan - Request driver to start a scan
- * @wpa_s: Pointer to wpa_supplicant data
- * @params: Scan parameters
- * Returns: 0 on success, -1 on failure
+/*
+ * Fixed-size channel bitmap used for building scan frequency sets without
+ * repeated allocation and sorting. Bit 1..13 cover 2.4 GHz channels 1..13
+ * (2412-2472 MHz), bit 14 channel 14 (2484 MHz) and the remaining bits the
+ * 5 MHz raster from 4900 MHz up to the end of the 6 GHz band (7125 MHz).
+ * The few frequencies outside these ranges are kept in a short overflow list.
  */
-int wpa_supplicant_trigger_scan(struct wpa_supplicant *wpa_s,
-				struct wpa_driver_scan_params *params)
-{
-	struct wpa_driver_scan_params *ctx;
-
-	if (wpa_s->scan_work) {
-		wpa_dbg(wpa_s, MSG_INFO, "Reject scan trigger since one is already pending");
-		return -1;
-	}
+#define WPAS_CHAN_BITMAP_4900_BIT 15
+#define WPAS_CHAN_BITMAP_BITS \
+	(WPAS_CHAN_BITMAP_4900_BIT + (7125 - 4900) / 5 + 1)
+#define WPAS_CHAN_BITMAP_WORDS ((WPAS_CHAN_BITMAP_BITS + 31) / 32)
+#define WPAS_CHAN_BITMAP_OTHER 8
 
-	ctx = wpa_scan_clone_params(params);
-	if (ctx == NULL)
-		return -1;
+struct wpas_chan_bitmap {
+	u32 bits[WPAS_CHAN_BITMAP_WORDS];
+	int other[WPAS_CHAN_BITMAP_OTHER];
+	unsigned int num_other;
+};
 
-	if (radio_add_work(wpa_s, 0, "scan", 0, wpas_trigger_scan_cb, ctx) < 0)
-	{
-		wpa_scan_free_params(ctx);
-		return -1;
-	}
 
-	return 0;
+static int wpas_chan_bitmap_bit(int freq)
+{
+	if (freq >= 2412 && freq <= 2472 && (freq - 2407) % 5 == 0)
+		return (freq - 2407) / 5;
+	if (freq == 2484)
+		return 14;
+	if (freq >= 4900 && freq <= 7125 && freq % 5 == 0)
+		return WPAS_CHAN_BITMAP_4900_BIT + (freq - 4900) / 5;
+	return -1;
+}
+
+
+static int wpas_chan_bitmap_freq(int bit)
+{
+	if (bit < 14)
+		return 2407 + bit * 5;
+	if (bit == 14)
+		return 2484;
+	return 4900 + (bit - WPAS_CHAN_BITMAP_4900_BIT) * 5;
+}
+
+
+static void wpas_chan_bitmap_init(struct wpas_chan_bitmap *bm)
+{
+	os_memset(bm, 0, sizeof(*bm));
+}
+
+
+static int wpas_chan_bitmap_test(const struct wpas_chan_bitmap *bm, int freq)
+{
+	int bit = wpas_chan_bitmap_bit(freq);
+	unsigned int i;
+
+	if (bit >= 0)
+		return !!(bm->bits[bit / 32] & BIT(bit % 32));
+	for (i = 0; i < bm->num_other; i++) {
+		if (bm->other[i] == freq)
+			return 1;
+	}
+	return 0;
+}
+
+
+static int wpas_chan_bitmap_add(struct wpas_chan_bitmap *bm, int freq)
+{
+	int bit;
+
+	if (freq <= 0)
+		return 0;
+	bit = wpas_chan_bitmap_bit(freq);
+	if (bit >= 0) {
+		bm->bits[bit / 32] |= BIT(bit % 32);
+		return 0;
+	}
+	if (wpas_chan_bitmap_test(bm, freq))
+		return 0;
+	if (bm->num_other == WPAS_CHAN_BITMAP_OTHER) {
+		wpa_printf(MSG_DEBUG,
+			   "Channel bitmap: no room for frequency %d MHz",
+			   freq);
+		return -1;
+	}
+	bm->other[bm->num_other++] = freq;
+	return 0;
+}
+
+
+static int wpas_chan_bitmap_add_list(struct wpas_chan_bitmap *bm,
+				     const int *freqs)
+{
+	int ret = 0;
+
+	for (; freqs && *freqs; freqs++) {
+		if (wpas_chan_bitmap_add(bm, *freqs) < 0)
+			ret = -1;
+	}
+	return ret;
+}
+
+
+static void wpas_chan_bitmap_intersect(struct wpas_chan_bitmap *dst,
+				       const struct wpas_chan_bitmap *src)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < WPAS_CHAN_BITMAP_WORDS; i++)
+		dst->bits[i] &= src->bits[i];
+	for (i = 0, j = 0; i < dst->num_other; i++) {
+		if (wpas_chan_bitmap_test(src, dst->other[i]))
+			dst->other[j++] = dst->other[i];
+	}
+	dst->num_other = j;
+}
+
+
+static unsigned int wpas_chan_bitmap_count(const struct wpas_chan_bitmap *bm)
+{
+	unsigned int i, count = bm->num_other;
+	u32 w;
+
+	for (i = 0; i < WPAS_CHAN_BITMAP_WORDS; i++) {
+		for (w = bm->bits[i]; w; w &= w - 1)
+			count++;
+	}
+	return count;
+}
+
+
+/*
+ * Convert a channel bitmap into the allocated, zero-terminated and sorted
+ * frequency list used in driver scan parameters. Returns %NULL if the bitmap
+ * is empty or on allocation failure.
+ */
+static int * wpas_chan_bitmap_to_list(const struct wpas_chan_bitmap *bm)
+{
+	unsigned int count, i, pos = 0;
+	int *freqs, bit;
+
+	count = wpas_chan_bitmap_count(bm);
+	if (!count)
+		return NULL;
+	freqs = os_calloc(count + 1, sizeof(int));
+	if (!freqs)
+		return NULL;
+
+	for (bit = 0; bit < WPAS_CHAN_BITMAP_BITS; bit++) {
+		if (bm->bits[bit / 32] & BIT(bit % 32))
+			freqs[pos++] = wpas_chan_bitmap_freq(bit);
+	}
+	for (i = 0; i < bm->num_other; i++)
+		freqs[pos++] = bm->other[i];
+	if (bm->num_other)
+		int_array_sort_unique(freqs);
+
+	return freqs;
+}
+
+
+static int wpa_scan_has_ssid(const struct wpa_driver_scan_params *params,
+			     const u8 *ssid, size_t ssid_len)
+{
+	size_t i;
+
+	for (i = 0; i < params->num_ssids; i++) {
+		if (params->ssids[i].ssid_len == ssid_len &&
+		    (ssid_len == 0 ||
+		     os_memcmp(params->ssids[i].ssid, ssid, ssid_len) == 0))
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Merge a new scan request into the parameters of a queued scan work item
+ * that has not yet been started. The result covers both requests: union of
+ * SSIDs, frequencies and SSID filters, active scan if either request was
+ * active, and only_new_results if either request asked for it. Requests with
+ * different Probe Request IEs or MAC address randomization are not merged.
+ * Returns 0 on success or -1 if the requests cannot be covered by a single
+ * driver scan.
+ */
+static int wpa_scan_merge_params(struct wpa_supplicant *wpa_s,
+				 struct wpa_driver_scan_params *dst,
+				 const struct wpa_driver_scan_params *src)
+{
+	size_t i, j, num_ssids, max_ssids, num_filter = 0;
+	struct wpa_driver_scan_filter *filter = NULL;
+	struct wpas_chan_bitmap bm;
+	int *freqs = NULL;
+
+	max_ssids = wpa_s->max_scan_ssids;
+	if (max_ssids > WPAS_MAX_SCAN_SSIDS || max_ssids == 0)
+		max_ssids = WPAS_MAX_SCAN_SSIDS;
+
+	num_ssids = dst->num_ssids;
+	for (i = 0; i < src->num_ssids; i++) {
+		if (!wpa_scan_has_ssid(dst, src->ssids[i].ssid,
+				       src->ssids[i].ssid_len))
+			num_ssids++;
+	}
+	if (num_ssids > max_ssids) {
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"Cannot merge scan request: too many SSIDs (%u > %u)",
+			(unsigned int) num_ssids, (unsigned int) max_ssids);
+		return -1;
+	}
+
+	if (dst->bssid && (!src->bssid ||
+			   os_memcmp(dst->bssid, src->bssid, ETH_ALEN) != 0)) {
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"Cannot merge scan request: different target BSSID");
+		return -1;
+	}
+
+	/* The Probe Request frames must carry what each requester asked for */
+	if (dst->extra_ies_len != src->extra_ies_len ||
+	    (dst->extra_ies_len &&
+	     os_memcmp(dst->extra_ies, src->extra_ies,
+		       dst->extra_ies_len) != 0) ||
+	    dst->p2p_probe != src->p2p_probe) {
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"Cannot merge scan request: different Probe Request IEs");
+		return -1;
+	}
+
+	if (dst->mac_addr_rand != src->mac_addr_rand ||
+	    (dst->mac_addr_rand &&
+	     (!dst->mac_addr != !src->mac_addr ||
+	      !dst->mac_addr_mask != !src->mac_addr_mask ||
+	      (dst->mac_addr &&
+	       os_memcmp(dst->mac_addr, src->mac_addr, ETH_ALEN) != 0) ||
+	      (dst->mac_addr_mask &&
+	       os_memcmp(dst->mac_addr_mask, src->mac_addr_mask,
+			 ETH_ALEN) != 0)))) {
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"Cannot merge scan request: different MAC address randomization");
+		return -1;
+	}
+
+	/* A missing frequency list means all channels */
+	if (dst->freqs && src->freqs) {
+		wpas_chan_bitmap_init(&bm);
+		if (wpas_chan_bitmap_add_list(&bm, dst->freqs) < 0 ||
+		    wpas_chan_bitmap_add_list(&bm, src->freqs) < 0)
+			return -1;
+		freqs = wpas_chan_bitmap_to_list(&bm);
+		if (freqs == NULL)
+			return -1;
+	}
+
+	/*
+	 * Filtering must not hide results that either requester needs, so the
+	 * merged filter is the union of both filters or no filter at all.
+	 */
+	if (dst->filter_ssids && src->filter_ssids) {
+		filter = os_calloc(dst->num_filter_ssids +
+				   src->num_filter_ssids, sizeof(*filter));
+		if (filter == NULL) {
+			os_free(freqs);
+			return -1;
+		}
+		os_memcpy(filter, dst->filter_ssids,
+			  dst->num_filter_ssids * sizeof(*filter));
+		num_filter = dst->num_filter_ssids;
+		for (i = 0; i < src->num_filter_ssids; i++) {
+			const struct wpa_driver_scan_filter *f =
+				&src->filter_ssids[i];
+
+			for (j = 0; j < num_filter; j++) {
+				if (filter[j].ssid_len == f->ssid_len &&
+				    os_memcmp(filter[j].ssid, f->ssid,
+					      f->ssid_len) == 0)
+					break;
+			}
+			if (j == num_filter)
+				filter[num_filter++] = *f;
+		}
+	}
+
+	for (i = 0; i < src->num_ssids; i++) {
+		u8 *n = NULL;
+
+		if (wpa_scan_has_ssid(dst, src->ssids[i].ssid,
+				      src->ssids[i].ssid_len))
+			continue;
+		if (src->ssids[i].ssid_len) {
+			n = os_memdup(src->ssids[i].ssid,
+				      src->ssids[i].ssid_len);
+			if (n == NULL) {
+				os_free(freqs);
+				os_free(filter);
+				return -1;
+			}
+		}
+		dst->ssids[dst->num_ssids].ssid = n;
+		dst->ssids[dst->num_ssids].ssid_len = src->ssids[i].ssid_len;
+		dst->num_ssids++;
+	}
+
+	os_free(dst->freqs);
+	dst->freqs = freqs;
+
+	if (filter || !src->filter_ssids) {
+		os_free(dst->filter_ssids);
+		dst->filter_ssids = filter;
+		dst->num_filter_ssids = num_filter;
+	}
+
+	if (dst->filter_rssi &&
+	    (src->filter_rssi == 0 || src->filter_rssi < dst->filter_rssi))
+		dst->filter_rssi = src->filter_rssi;
+	dst->only_new_results |= src->only_new_results;
+	dst->low_priority &= src->low_priority;
+
+	return 0;
+}
+
+
+/**
+ * wpa_supplicant_trigger_scan - Request driver to start a scan
+ * @wpa_s: Pointer to wpa_supplicant data
+ * @params: Scan parameters
+ * Returns: 0 on success, -1 on failure
+ *
+ * If a scan work item is already queued but has not yet been started, the new
+ * request is merged into it so that all requesters share a single driver scan
+ * instead of each one retrying separately.
+ */
+int wpa_supplicant_trigger_scan(struct wpa_supplicant *wpa_s,
+				struct wpa_driver_scan_params *params)
+{
+	struct wpa_driver_scan_params *ctx;
+	struct wpas_scan_stats *stats;
+	struct wpas_scan_stats_queued *queued;
+
+	if (wpa_s->pending_scan_params) {
+		if (wpas_scan_merge_handler(wpa_s, 0) < 0 ||
+		    wpa_scan_merge_params(wpa_s, wpa_s->pending_scan_params,
+					  params) < 0) {
+			/* Keep the handler of the pending scan */
+			if (wpa_s->scan_merge)
+				wpa_s->scan_res_handler =
+					wpa_s->scan_merge->installed;
+			wpa_dbg(wpa_s, MSG_INFO, "Reject scan trigger since one is already pending");
+			return -1;
+		}
+		wpas_scan_merge_handler(wpa_s, 1);
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"Merged scan request into the pending scan work");
+		return 0;
+	}
+
+	ctx = wpa_scan_clone_params(params);
+	if (ctx == NULL)
+		return -1;
+
+	if (radio_add_work(wpa_s, 0, "scan", 0, wpas_trigger_scan_cb, ctx) < 0)
+	{
+		wpa_scan_free_params(ctx);
+		return -1;
+	}
+
+	if (wpa_s->scan_work)
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"Scan already running - queued follow-up scan work");
+	wpa_s->pending_scan_params = ctx;
+	wpas_scan_merge_first(wpa_s);
+	stats = wpas_scan_stats_get(wpa_s);
+	queued = stats ? wpas_scan_stats_queued_get(stats, NULL) : NULL;
+	if (queued) {
+		queued->params = ctx;
+		os_get_reltime(&queued->request);
+	}
+
+	return 0;
 }
 
 
@@ -399,12 +1444,14 @@ static void wpa_supplicant_optimize_freqs(
 				params->freqs[0] = wpa_s->go_params->freq;
 		} else if (wpa_s->p2p_in_provisioning < 8 &&
 			   wpa_s->go_params->freq_list[0]) {
+			struct wpas_chan_bitmap bm;
+
 			wpa_dbg(wpa_s, MSG_DEBUG, "P2P: Scan only common "
 				"channels");
-			int_array_concat(&params->freqs,
-					 wpa_s->go_params->freq_list);
-			if (params->freqs)
-				int_array_sort_unique(params->freqs);
+			wpas_chan_bitmap_init(&bm);
+			if (wpas_chan_bitmap_add_list(
+				    &bm, wpa_s->go_params->freq_list) == 0)
+				params->freqs = wpas_chan_bitmap_to_list(&bm);
 		}
 		wpa_s->p2p_in_provisioning++;
 	}
@@ -588,116 +1635,1497 @@ static struct hostapd_hw_modes * get_mode(struct hostapd_hw_modes *modes,
 }
 
 
+/*
+ * 6 GHz discovery
+ *
+ * With scan_6ghz_psc enabled, scans that would cover the whole 6 GHz band
+ * only include the Preferred Scanning Channels (every fourth 20 MHz channel,
+ * see IEEE Std 802.11ax, 26.17.2.3.3) on which 6 GHz APs are required to be
+ * discoverable. Other 6 GHz channels are scanned only when a Reduced Neighbor
+ * Report element in a beacon or probe response in the BSS table, e.g., a
+ * co-located AP report from a 2.4/5 GHz AP, points to them.
+ */
+#ifndef WLAN_EID_REDUCED_NEIGHBOR_REPORT
+#define WLAN_EID_REDUCED_NEIGHBOR_REPORT 201
+#endif /* WLAN_EID_REDUCED_NEIGHBOR_REPORT */
+
+static int wpas_freq_is_6ghz(int freq)
+{
+	return freq == 5935 || (freq >= 5955 && freq <= 7115);
+}
+
+
+static int wpas_freq_is_6ghz_psc(int freq)
+{
+	return freq >= 5955 && freq <= 7115 && (freq - 5950) % 80 == 25;
+}
+
+
+static int wpas_6ghz_op_class_freq(u8 op_class, u8 chan)
+{
+	if (op_class == 136)
+		return chan == 2 ? 5935 : 0;
+	if (op_class < 131 || op_class > 137 || chan < 1 || chan > 233)
+		return 0;
+	return 5950 + chan * 5;
+}
+
+
+/* Add the 6 GHz channels advertised in Reduced Neighbor Report elements */
+static void wpas_6ghz_rnr_freqs(struct wpa_supplicant *wpa_s,
+				struct wpas_chan_bitmap *bm)
+{
+	struct wpa_bss *bss;
+	const u8 *ie, *pos, *end;
+	size_t len;
+	u16 hdr;
+	int freq;
+
+	dl_list_for_each(bss, &wpa_s->bss, struct wpa_bss, list) {
+		ie = wpa_bss_get_ie(bss, WLAN_EID_REDUCED_NEIGHBOR_REPORT);
+		if (!ie)
+			continue;
+		pos = ie + 2;
+		end = pos + ie[1];
+
+		/* Neighbor AP Information fields */
+		while (end - pos >= 4) {
+			hdr = WPA_GET_LE16(pos);
+			/* TBTT Information Count + 1 fields of TBTT Info Len */
+			len = (size_t) (hdr >> 8) * (((hdr >> 4) & 0x0f) + 1);
+			freq = wpas_6ghz_op_class_freq(pos[2], pos[3]);
+			pos += 4;
+			if ((size_t) (end - pos) < len)
+				break;
+			pos += len;
+			if (freq)
+				wpas_chan_bitmap_add(bm, freq);
+		}
+	}
+}
+
+
+/*
+ * Remove the non-PSC 6 GHz channels that no Reduced Neighbor Report points
+ * to from a channel set. Returns the number of removed channels.
+ */
+static unsigned int wpas_scan_6ghz_filter(struct wpa_supplicant *wpa_s,
+					  struct wpas_chan_bitmap *bm)
+{
+	struct wpas_chan_bitmap rnr;
+	unsigned int removed = 0, psc = 0, i;
+	int freq;
+
+	wpas_chan_bitmap_init(&rnr);
+	wpas_6ghz_rnr_freqs(wpa_s, &rnr);
+
+	for (freq = 5935; freq <= 7115; freq += 5) {
+		if (!wpas_freq_is_6ghz(freq) || !wpas_chan_bitmap_test(bm, freq))
+			continue;
+		if (wpas_freq_is_6ghz_psc(freq)) {
+			psc++;
+			continue;
+		}
+		if (wpas_chan_bitmap_test(&rnr, freq))
+			continue;
+		i = wpas_chan_bitmap_bit(freq);
+		bm->bits[i / 32] &= ~BIT(i % 32);
+		removed++;
+	}
+
+	if (removed)
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"6 GHz discovery: %u PSC and %u RNR channel(s), skip %u other channel(s)",
+			psc, wpas_chan_bitmap_count(&rnr), removed);
+	return removed;
+}
+
+
 static void wpa_setband_scan_freqs_list(struct wpa_supplicant *wpa_s,
 					enum hostapd_hw_mode band,
 					struct wpa_driver_scan_params *params)
 {
 	/* Include only supported channels for the specified band */
 	struct hostapd_hw_modes *mode;
+	struct wpas_chan_bitmap bm;
 	int count, i;
 
-	mode = get_mode(wpa_s->hw.modes, wpa_s->hw.num_modes, band);
-	if (mode == NULL) {
-		/* No channels supported in this band - use empty list */
-		params->freqs = os_zalloc(sizeof(int));
+	mode = get_mode(wpa_s->hw.modes, wpa_s->hw.num_modes, band);
+	if (mode == NULL) {
+		/* No channels supported in this band - use empty list */
+		params->freqs = os_zalloc(sizeof(int));
+		return;
+	}
+
+	if (wpa_s->conf->scan_6ghz_psc && band == HOSTAPD_MODE_IEEE80211A) {
+		wpas_chan_bitmap_init(&bm);
+		for (i = 0; i < mode->num_channels; i++) {
+			if (!(mode->channels[i].flag & HOSTAPD_CHAN_DISABLED))
+				wpas_chan_bitmap_add(&bm,
+						     mode->channels[i].freq);
+		}
+		if (wpas_scan_6ghz_filter(wpa_s, &bm)) {
+			params->freqs = wpas_chan_bitmap_to_list(&bm);
+			return;
+		}
+	}
+
+	params->freqs = os_calloc(mode->num_channels + 1, sizeof(int));
+	if (params->freqs == NULL)
+		return;
+	for (count = 0, i = 0; i < mode->num_channels; i++) {
+		if (mode->channels[i].flag & HOSTAPD_CHAN_DISABLED)
+			continue;
+		params->freqs[count++] = mode->channels[i].freq;
+	}
+}
+
+
+static void wpa_setband_scan_freqs(struct wpa_supplicant *wpa_s,
+				   struct wpa_driver_scan_params *params)
+{
+	if (wpa_s->hw.modes == NULL)
+		return; /* unknown what channels the driver supports */
+	if (params->freqs)
+		return; /* already using a limited channel set */
+	if (wpa_s->setband == WPA_SETBAND_5G)
+		wpa_setband_scan_freqs_list(wpa_s, HOSTAPD_MODE_IEEE80211A,
+					    params);
+	else if (wpa_s->setband == WPA_SETBAND_2G)
+		wpa_setband_scan_freqs_list(wpa_s, HOSTAPD_MODE_IEEE80211G,
+					    params);
+}
+
+
+/*
+ * Hash set of the SSIDs in a scan request. Entries are indexes into
+ * params->ssids plus one (zero marks an empty bucket).
+ */
+#define WPAS_SCAN_SSID_SET_SIZE (2 * WPAS_MAX_SCAN_SSIDS)
+
+struct wpas_scan_ssid_set {
+	u8 bucket[WPAS_SCAN_SSID_SET_SIZE];
+};
+
+
+static u32 wpas_scan_ssid_hash(const u8 *ssid, size_t ssid_len)
+{
+	u32 hash = 2166136261U; /* FNV-1a */
+	size_t i;
+
+	for (i = 0; i < ssid_len; i++) {
+		hash ^= ssid[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+static void wpas_scan_ssid_set_init(struct wpas_scan_ssid_set *set)
+{
+	os_memset(set, 0, sizeof(*set));
+}
+
+
+static int wpas_scan_ssid_set_contains(
+	const struct wpas_scan_ssid_set *set,
+	const struct wpa_driver_scan_params *params,
+	const u8 *ssid, size_t ssid_len)
+{
+	unsigned int pos = wpas_scan_ssid_hash(ssid, ssid_len) %
+		WPAS_SCAN_SSID_SET_SIZE;
+	const struct wpa_driver_scan_ssid *s;
+
+	while (set->bucket[pos]) {
+		s = &params->ssids[set->bucket[pos] - 1];
+		if (s->ssid_len == ssid_len &&
+		    (ssid_len == 0 || os_memcmp(s->ssid, ssid, ssid_len) == 0))
+			return 1;
+		pos = (pos + 1) % WPAS_SCAN_SSID_SET_SIZE;
+	}
+
+	return 0;
+}
+
+
+static void wpas_scan_ssid_set_add(struct wpas_scan_ssid_set *set,
+				   const struct wpa_driver_scan_params *params,
+				   size_t idx)
+{
+	const struct wpa_driver_scan_ssid *s = &params->ssids[idx];
+	unsigned int pos;
+
+	if (wpas_scan_ssid_set_contains(set, params, s->ssid, s->ssid_len))
+		return;
+	pos = wpas_scan_ssid_hash(s->ssid, s->ssid_len) %
+		WPAS_SCAN_SSID_SET_SIZE;
+	while (set->bucket[pos])
+		pos = (pos + 1) % WPAS_SCAN_SSID_SET_SIZE;
+	set->bucket[pos] = idx + 1;
+}
+
+
+static void wpa_set_scan_ssids(struct wpa_supplicant *wpa_s,
+			       struct wpa_driver_scan_params *params,
+			       size_t max_ssids)
+{
+	unsigned int i;
+	struct wpa_ssid *ssid, *id_ssid[ARRAY_SIZE(wpa_s->scan_id)];
+	struct wpas_scan_ssid_set set;
+
+	wpas_scan_ssid_set_init(&set);
+	for (i = 0; i < params->num_ssids; i++)
+		wpas_scan_ssid_set_add(&set, params, i);
+
+	/* Resolve all requested ids in a single pass over the network list */
+	os_memset(id_ssid, 0, sizeof(id_ssid));
+	for (ssid = wpa_s->conf->ssid; ssid; ssid = ssid->next) {
+		for (i = 0; i < wpa_s->scan_id_count; i++) {
+			if (wpa_s->scan_id[i] == ssid->id && !id_ssid[i])
+				id_ssid[i] = ssid;
+		}
+	}
+
+	for (i = 0; i < wpa_s->scan_id_count; i++) {
+		ssid = id_ssid[i];
+		if (!ssid || !ssid->scan_ssid)
+			continue;
+
+		if (wpas_scan_ssid_set_contains(&set, params, ssid->ssid,
+						ssid->ssid_len))
+			continue; /* already in the list */
+
+		if (params->num_ssids + 1 > max_ssids) {
+			wpa_printf(MSG_DEBUG,
+				   "Over max scan SSIDs for manual request");
+			break;
+		}
+
+		wpa_printf(MSG_DEBUG, "Scan SSID (manual request): %s",
+			   wpa_ssid_txt(ssid->ssid, ssid->ssid_len));
+		params->ssids[params->num_ssids].ssid = ssid->ssid;
+		params->ssids[params->num_ssids].ssid_len = ssid->ssid_len;
+		wpas_scan_ssid_set_add(&set, params, params->num_ssids);
+		params->num_ssids++;
+	}
+
+	wpa_s->scan_id_count = 0;
+}
+
+
+/*
+ * Hash set of the enabled networks by SSID. It is built once per processed
+ * set of scan results so that matching each result against the configuration
+ * does not walk the network list. Networks sharing an SSID are found in list
+ * order.
+ */
+struct wpas_network_set {
+	struct wpa_ssid **bucket;
+	size_t size; /* power of two */
+};
+
+
+static int wpas_network_set_init(struct wpa_supplicant *wpa_s,
+				 struct wpas_network_set *set)
+{
+	struct wpa_ssid *ssid;
+	size_t count = 0, pos;
+
+	os_memset(set, 0, sizeof(*set));
+	for (ssid = wpa_s->conf->ssid; ssid; ssid = ssid->next) {
+		if (ssid->ssid_len && !wpas_network_disabled(wpa_s, ssid))
+			count++;
+	}
+	if (!count)
+		return 0;
+
+	set->size = 8;
+	while (set->size < 2 * count)
+		set->size *= 2;
+	set->bucket = os_calloc(set->size, sizeof(*set->bucket));
+	if (!set->bucket) {
+		set->size = 0;
+		return -1;
+	}
+
+	for (ssid = wpa_s->conf->ssid; ssid; ssid = ssid->next) {
+		if (!ssid->ssid_len || wpas_network_disabled(wpa_s, ssid))
+			continue;
+		pos = wpas_scan_ssid_hash(ssid->ssid, ssid->ssid_len) &
+			(set->size - 1);
+		while (set->bucket[pos])
+			pos = (pos + 1) & (set->size - 1);
+		set->bucket[pos] = ssid;
+	}
+
+	return 0;
+}
+
+
+static struct wpa_ssid *
+wpas_network_set_get(const struct wpas_network_set *set, const u8 *ssid,
+		     size_t ssid_len)
+{
+	struct wpa_ssid *s;
+	size_t pos;
+
+	if (!set->size || !ssid_len)
+		return NULL;
+
+	pos = wpas_scan_ssid_hash(ssid, ssid_len) & (set->size - 1);
+	while ((s = set->bucket[pos])) {
+		if (s->ssid_len == ssid_len &&
+		    os_memcmp(s->ssid, ssid, ssid_len) == 0)
+			return s;
+		pos = (pos + 1) & (set->size - 1);
+	}
+
+	return NULL;
+}
+
+
+static void wpas_network_set_deinit(struct wpas_network_set *set)
+{
+	os_free(set->bucket);
+	set->bucket = NULL;
+	set->size = 0;
+}
+
+
+static int wpa_set_ssids_from_scan_req(struct wpa_supplicant *wpa_s,
+				       struct wpa_driver_scan_params *params,
+				       size_t max_ssids)
+{
+	unsigned int i;
+
+	if (wpa_s->ssids_from_scan_req == NULL ||
+	    wpa_s->num_ssids_from_scan_req == 0)
+		return 0;
+
+	if (wpa_s->num_ssids_from_scan_req > max_ssids) {
+		wpa_s->num_ssids_from_scan_req = max_ssids;
+		wpa_printf(MSG_DEBUG, "Over max scan SSIDs from scan req: %u",
+			   (unsigned int) max_ssids);
+	}
+
+	for (i = 0; i < wpa_s->num_ssids_from_scan_req; i++) {
+		params->ssids[i].ssid = wpa_s->ssids_from_scan_req[i].ssid;
+		params->ssids[i].ssid_len =
+			wpa_s->ssids_from_scan_req[i].ssid_len;
+		wpa_hexdump_ascii(MSG_DEBUG, "specific SSID",
+				  params->ssids[i].ssid,
+				  params->ssids[i].ssid_len);
+	}
+
+	params->num_ssids = wpa_s->num_ssids_from_scan_req;
+	wpa_s->num_ssids_from_scan_req = 0;
+	return 1;
+}
+
+
+#define IS_5GHZ(n) (n > 4000)
+
+
+/* Whether freq_list and setband allow scanning a frequency */
+static int wpas_scan_freq_allowed(struct wpa_supplicant *wpa_s, int freq)
+{
+	if (wpa_s->conf->freq_list &&
+	    !int_array_includes(wpa_s->conf->freq_list, freq))
+		return 0;
+	if (wpa_s->setband == WPA_SETBAND_5G && !IS_5GHZ(freq))
+		return 0;
+	if (wpa_s->setband == WPA_SETBAND_2G && IS_5GHZ(freq))
+		return 0;
+	return 1;
+}
+
+
+/*
+ * Channel history
+ *
+ * For each configured network, remember the channels on which its BSSs have
+ * been seen in scan results and on which the interface has been associated
+ * with it, so that reconnection scans can first target those channels. Scan
+ * results are matched against a per-scan hash set of the enabled networks.
+ * Sighting times are kept with WPAS_CHAN_HIST_SEEN_RES resolution so that a
+ * network that stays in view does not change the history with every scan.
+ * Entries are keyed by SSID (network ids are not stable across restarts) and
+ * optionally persisted to conf->channel_history_file from a timer and at
+ * deinit, never directly from the scan result path.
+ */
+
+/* Maximum number of channels remembered per SSID */
+#define WPAS_CHAN_HIST_FREQS 8
+/* Maximum number of SSIDs in the channel history */
+#define WPAS_CHAN_HIST_SSIDS 64
+/* Channels not seen for this long are forgotten (seconds) */
+#define WPAS_CHAN_HIST_MAX_AGE (30 * 24 * 60 * 60)
+/* Delay from a channel history change to writing the file (seconds) */
+#define WPAS_CHAN_HIST_SAVE_INTERVAL 60
+/* Resolution of the time a channel was last seen on (seconds) */
+#define WPAS_CHAN_HIST_SEEN_RES (10 * 60)
+
+struct wpas_chan_hist_entry {
+	u8 ssid[SSID_MAX_LEN];
+	size_t ssid_len;
+	int freq[WPAS_CHAN_HIST_FREQS];
+	os_time_t last_seen[WPAS_CHAN_HIST_FREQS];
+	os_time_t last_assoc;
+	unsigned int num_assoc;
+};
+
+struct wpas_chan_hist {
+	struct wpas_chan_hist_entry entry[WPAS_CHAN_HIST_SSIDS];
+	unsigned int num;
+	int dirty;
+};
+
+
+static struct wpas_chan_hist_entry *
+wpas_chan_hist_find(struct wpas_chan_hist *hist, const u8 *ssid,
+		    size_t ssid_len)
+{
+	unsigned int i;
+
+	for (i = 0; i < hist->num; i++) {
+		if (hist->entry[i].ssid_len == ssid_len &&
+		    os_memcmp(hist->entry[i].ssid, ssid, ssid_len) == 0)
+			return &hist->entry[i];
+	}
+
+	return NULL;
+}
+
+
+/* Most recent time a BSS of the SSID was seen in scan results */
+static os_time_t wpas_chan_hist_last_seen(struct wpas_chan_hist_entry *e)
+{
+	os_time_t newest = 0;
+	unsigned int i;
+
+	for (i = 0; i < WPAS_CHAN_HIST_FREQS && e->freq[i]; i++) {
+		if (e->last_seen[i] > newest)
+			newest = e->last_seen[i];
+	}
+
+	return newest;
+}
+
+
+/* Most recent time the SSID was seen or associated with */
+static os_time_t wpas_chan_hist_last_used(struct wpas_chan_hist_entry *e)
+{
+	os_time_t seen = wpas_chan_hist_last_seen(e);
+
+	return e->last_assoc > seen ? e->last_assoc : seen;
+}
+
+
+/* Find or add a channel history entry for an SSID */
+static struct wpas_chan_hist_entry *
+wpas_chan_hist_entry_get(struct wpas_chan_hist *hist, const u8 *ssid,
+			 size_t ssid_len)
+{
+	struct wpas_chan_hist_entry *e;
+	unsigned int i;
+
+	if (ssid_len == 0 || ssid_len > SSID_MAX_LEN)
+		return NULL;
+
+	e = wpas_chan_hist_find(hist, ssid, ssid_len);
+	if (!e) {
+		if (hist->num < WPAS_CHAN_HIST_SSIDS) {
+			e = &hist->entry[hist->num++];
+		} else {
+			/* Replace the SSID that has not been seen longest */
+			e = &hist->entry[0];
+			for (i = 1; i < hist->num; i++) {
+				if (wpas_chan_hist_last_used(&hist->entry[i]) <
+				    wpas_chan_hist_last_used(e))
+					e = &hist->entry[i];
+			}
+		}
+		os_memset(e, 0, sizeof(*e));
+		os_memcpy(e->ssid, ssid, ssid_len);
+		e->ssid_len = ssid_len;
+	}
+
+	return e;
+}
+
+
+static void wpas_chan_hist_add(struct wpas_chan_hist *hist, const u8 *ssid,
+			       size_t ssid_len, int freq, os_time_t seen)
+{
+	struct wpas_chan_hist_entry *e;
+	unsigned int i, oldest;
+
+	if (freq <= 0)
+		return;
+	e = wpas_chan_hist_entry_get(hist, ssid, ssid_len);
+	if (!e)
+		return;
+
+	oldest = 0;
+	for (i = 0; i < WPAS_CHAN_HIST_FREQS; i++) {
+		if (e->freq[i] == freq || e->freq[i] == 0)
+			break;
+		if (e->last_seen[i] < e->last_seen[oldest])
+			oldest = i;
+	}
+	if (i == WPAS_CHAN_HIST_FREQS)
+		i = oldest;
+	if (e->freq[i] == freq &&
+	    seen - e->last_seen[i] < WPAS_CHAN_HIST_SEEN_RES)
+		return;
+	e->freq[i] = freq;
+	e->last_seen[i] = seen;
+	hist->dirty = 1;
+}
+
+
+static void wpas_chan_hist_load(struct wpa_supplicant *wpa_s,
+				struct wpas_chan_hist *hist)
+{
+	const char *fname = wpa_s->conf->channel_history_file;
+	char buf[512], *pos, *end;
+	u8 ssid[SSID_MAX_LEN];
+	size_t ssid_len;
+	struct os_time now;
+	FILE *f;
+
+	if (!fname)
+		return;
+
+	f = fopen(fname, "r");
+	if (!f) {
+		wpa_dbg(wpa_s, MSG_DEBUG, "No channel history in '%s'", fname);
+		return;
+	}
+
+	os_get_time(&now);
+	while (fgets(buf, sizeof(buf), f)) {
+		pos = os_strchr(buf, ' ');
+		if (!pos)
+			continue;
+		*pos++ = '\0';
+		ssid_len = os_strlen(buf) / 2;
+		if (ssid_len == 0 || ssid_len > SSID_MAX_LEN ||
+		    os_strlen(buf) & 1 ||
+		    hexstr2bin(buf, ssid, ssid_len) < 0)
+			continue;
+
+		/*
+		 * <freq>:<last seen> pairs, assoc:<last association> and
+		 * assocs:<number of associations>
+		 */
+		while (*pos) {
+			struct wpas_chan_hist_entry *e;
+			int freq;
+			long seen;
+
+			if (os_strncmp(pos, "assocs:", 7) == 0) {
+				seen = strtol(pos + 7, &end, 10);
+				if (end == pos + 7 || seen < 0)
+					break;
+				pos = end;
+				while (*pos == ' ' || *pos == '\n')
+					pos++;
+				e = wpas_chan_hist_entry_get(hist, ssid,
+							     ssid_len);
+				if (e)
+					e->num_assoc = seen;
+				continue;
+			}
+
+			if (os_strncmp(pos, "assoc:", 6) == 0) {
+				seen = strtol(pos + 6, &end, 10);
+				if (end == pos + 6)
+					break;
+				pos = end;
+				while (*pos == ' ' || *pos == '\n')
+					pos++;
+				e = wpas_chan_hist_entry_get(hist, ssid,
+							     ssid_len);
+				if (e && now.sec - seen <= WPAS_CHAN_HIST_MAX_AGE)
+					e->last_assoc = seen;
+				continue;
+			}
+
+			freq = strtol(pos, &end, 10);
+			if (end == pos || *end != ':')
+				break;
+			pos = end + 1;
+			seen = strtol(pos, &end, 10);
+			if (end == pos)
+				break;
+			pos = end;
+			while (*pos == ' ' || *pos == '\n')
+				pos++;
+			if (now.sec - seen > WPAS_CHAN_HIST_MAX_AGE)
+				continue;
+			wpas_chan_hist_add(hist, ssid, ssid_len, freq, seen);
+		}
+	}
+	fclose(f);
+
+	hist->dirty = 0;
+	wpa_dbg(wpa_s, MSG_DEBUG, "Loaded channel history for %u SSIDs",
+		hist->num);
+}
+
+
+static void wpas_chan_hist_save(struct wpa_supplicant *wpa_s,
+				struct wpas_chan_hist *hist)
+{
+	const char *fname = wpa_s->conf->channel_history_file;
+	char tmp[256], hex[2 * SSID_MAX_LEN + 1];
+	struct os_time now;
+	unsigned int i, j;
+	FILE *f;
+	int ret;
+
+	if (!fname || !hist->dirty)
+		return;
+
+	ret = os_snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+	if (os_snprintf_error(sizeof(tmp), ret))
+		return;
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		wpa_printf(MSG_DEBUG, "Failed to write channel history to '%s'",
+			   tmp);
+		return;
+	}
+
+	os_get_time(&now);
+	for (i = 0; i < hist->num; i++) {
+		struct wpas_chan_hist_entry *e = &hist->entry[i];
+
+		if (now.sec - wpas_chan_hist_last_used(e) >
+		    WPAS_CHAN_HIST_MAX_AGE)
+			continue;
+		wpa_snprintf_hex(hex, sizeof(hex), e->ssid, e->ssid_len);
+		fprintf(f, "%s", hex);
+		for (j = 0; j < WPAS_CHAN_HIST_FREQS && e->freq[j]; j++)
+			fprintf(f, " %d:%ld", e->freq[j],
+				(long) e->last_seen[j]);
+		if (e->last_assoc)
+			fprintf(f, " assoc:%ld", (long) e->last_assoc);
+		if (e->num_assoc)
+			fprintf(f, " assocs:%u", e->num_assoc);
+		fprintf(f, "\n");
+	}
+
+	if (fclose(f) != 0 || rename(tmp, fname) != 0) {
+		wpa_printf(MSG_DEBUG, "Failed to update channel history '%s'",
+			   fname);
+		unlink(tmp);
+		return;
+	}
+
+	hist->dirty = 0;
+}
+
+
+static struct wpas_chan_hist * wpas_chan_hist_get(struct wpa_supplicant *wpa_s)
+{
+	if (!wpa_s->chan_hist) {
+		wpa_s->chan_hist = os_zalloc(sizeof(struct wpas_chan_hist));
+		if (wpa_s->chan_hist)
+			wpas_chan_hist_load(wpa_s, wpa_s->chan_hist);
+	}
+
+	return wpa_s->chan_hist;
+}
+
+
+static void wpas_chan_hist_save_timeout(void *eloop_ctx, void *timeout_ctx)
+{
+	struct wpa_supplicant *wpa_s = eloop_ctx;
+
+	if (wpa_s->chan_hist)
+		wpas_chan_hist_save(wpa_s, wpa_s->chan_hist);
+}
+
+
+static void wpas_chan_hist_schedule_save(struct wpa_supplicant *wpa_s,
+					 struct wpas_chan_hist *hist)
+{
+	if (!hist->dirty || !wpa_s->conf->channel_history_file ||
+	    eloop_is_timeout_registered(wpas_chan_hist_save_timeout, wpa_s,
+					NULL))
+		return;
+	eloop_register_timeout(WPAS_CHAN_HIST_SAVE_INTERVAL, 0,
+			       wpas_chan_hist_save_timeout, wpa_s, NULL);
+}
+
+
+/* Record the channels on which BSSs of enabled networks were seen */
+static void wpas_chan_hist_update(struct wpa_supplicant *wpa_s,
+				  const struct wpas_network_set *networks,
+				  struct wpa_scan_results *scan_res)
+{
+	struct wpas_chan_hist *hist;
+	struct wpa_ssid *ssid;
+	struct os_time now;
+	const u8 *ie;
+	size_t i;
+
+	if (!networks->size)
+		return;
+	hist = wpas_chan_hist_get(wpa_s);
+	if (!hist)
+		return;
+
+	os_get_time(&now);
+	for (i = 0; i < scan_res->num; i++) {
+		ie = wpa_scan_get_ie(scan_res->res[i], WLAN_EID_SSID);
+		if (!ie)
+			continue;
+		ssid = wpas_network_set_get(networks, ie + 2, ie[1]);
+		if (ssid)
+			wpas_chan_hist_add(hist, ssid->ssid, ssid->ssid_len,
+					   scan_res->res[i]->freq, now.sec);
+	}
+	wpas_chan_hist_schedule_save(wpa_s, hist);
+}
+
+
+/* Add the channels on which enabled networks have been seen before */
+static void wpas_chan_hist_freqs(struct wpa_supplicant *wpa_s,
+				 struct wpas_chan_bitmap *bm)
+{
+	struct wpas_chan_hist *hist;
+	struct wpas_chan_hist_entry *e;
+	struct wpa_ssid *ssid;
+	unsigned int i;
+
+	hist = wpas_chan_hist_get(wpa_s);
+	if (!hist)
+		return;
+
+	for (ssid = wpa_s->conf->ssid; ssid; ssid = ssid->next) {
+		if (wpas_network_disabled(wpa_s, ssid) || !ssid->ssid_len)
+			continue;
+		e = wpas_chan_hist_find(hist, ssid->ssid, ssid->ssid_len);
+		if (!e)
+			continue;
+		for (i = 0; i < WPAS_CHAN_HIST_FREQS && e->freq[i]; i++) {
+			if (wpas_scan_freq_allowed(wpa_s, e->freq[i]))
+				wpas_chan_bitmap_add(bm, e->freq[i]);
+		}
+	}
+}
+
+
+/*
+ * An association counts as a sighting this much more recent (seconds) when
+ * ranking hidden SSIDs for probing.
+ */
+#define WPAS_SCAN_SSID_ASSOC_BONUS (60 * 60)
+
+/* Ranking score of a network for probing its hidden SSID (0 = no history) */
+static os_time_t wpas_scan_ssid_score(struct wpas_chan_hist *hist,
+				      struct wpa_ssid *ssid)
+{
+	struct wpas_chan_hist_entry *e;
+	os_time_t score;
+
+	e = wpas_chan_hist_find(hist, ssid->ssid, ssid->ssid_len);
+	if (!e)
+		return 0;
+	score = wpas_chan_hist_last_seen(e);
+	if (e->last_assoc && e->last_assoc + WPAS_SCAN_SSID_ASSOC_BONUS > score)
+		score = e->last_assoc + WPAS_SCAN_SSID_ASSOC_BONUS;
+	return score;
+}
+
+
+/*
+ * Rank the enabled scan_ssid networks by how likely they are to be nearby: the
+ * later of the last time a BSS of the network was seen and the last
+ * association plus a bonus, based on the channel history. This is only done if
+ * the networks and the wildcard SSID do not all fit into @max_ssids (> 2). Up
+ * to @max_ssids - 2 networks with any such history are stored in @ranked, most
+ * likely first. Returns the number of ranked networks.
+ */
+static size_t wpas_scan_ssid_rank(struct wpa_supplicant *wpa_s,
+				  size_t max_ssids, struct wpa_ssid **ranked)
+{
+	struct wpas_chan_hist *hist;
+	struct wpa_ssid *ssid;
+	os_time_t score[WPAS_MAX_SCAN_SSIDS], sc;
+	size_t j, pos, count = 0, num = 0, max = max_ssids - 2;
+
+	hist = wpas_chan_hist_get(wpa_s);
+	if (!hist || !hist->num)
+		return 0;
+
+	for (ssid = wpa_s->conf->ssid; ssid; ssid = ssid->next) {
+		if (wpas_network_disabled(wpa_s, ssid) || !ssid->scan_ssid)
+			continue;
+		count++;
+		sc = ssid->ssid_len ? wpas_scan_ssid_score(hist, ssid) : 0;
+		if (sc == 0)
+			continue;
+		/* Insert into the sorted top list; ties keep list order */
+		for (pos = num; pos > 0 && sc > score[pos - 1]; pos--)
+			;
+		if (pos == max)
+			continue;
+		if (num < max)
+			num++;
+		for (j = num - 1; j > pos; j--) {
+			score[j] = score[j - 1];
+			ranked[j] = ranked[j - 1];
+		}
+		score[pos] = sc;
+		ranked[pos] = ssid;
+	}
+
+	if (count + 1 <= max_ssids)
+		return 0; /* all fit, keep the list order */
+
+	for (j = 0; j < num; j++)
+		wpa_dbg(wpa_s, MSG_DEBUG, "Ranked scan SSID %u: %s",
+			(unsigned int) j,
+			wpa_ssid_txt(ranked[j]->ssid, ranked[j]->ssid_len));
+
+	return num;
+}
+
+
+/* Do not bother with a phase 1 connect scan on more channels than this */
+#define WPAS_CONNECT_SCAN_MAX_PREDICTED 16
+
+static void wpas_connect_scan_add_freq(struct wpa_supplicant *wpa_s,
+				       struct wpas_chan_bitmap *bm, int freq)
+{
+	if (freq > 0 && wpas_scan_freq_allowed(wpa_s, freq))
+		wpas_chan_bitmap_add(bm, freq);
+}
+
+
+/**
+ * wpas_connect_scan_predict_freqs - Predict the phase 1 connect scan channels
+ * @wpa_s: Pointer to wpa_supplicant data
+ * Returns: Allocated, zero-terminated array or %NULL if no useful prediction
+ * can be made
+ *
+ * The channels on which an enabled network is likely to be found are the last
+ * associated channel, the channel history, channels of matching entries in
+ * the BSS table and channels from received neighbor reports. This function is
+ * used for phase 1 of a connect scan and by the scan replay benchmark.
+ */
+int * wpas_connect_scan_predict_freqs(struct wpa_supplicant *wpa_s)
+{
+	struct wpa_bss *bss;
+	struct wpa_ssid *ssid;
+	struct wpas_chan_bitmap bm;
+	unsigned int count;
+#ifdef CONFIG_WNM
+	int i;
+#endif /* CONFIG_WNM */
+
+	wpas_chan_bitmap_init(&bm);
+	wpas_connect_scan_add_freq(wpa_s, &bm, wpa_s->assoc_freq);
+	wpas_chan_hist_freqs(wpa_s, &bm);
+
+	dl_list_for_each(bss, &wpa_s->bss, struct wpa_bss, list) {
+		for (ssid = wpa_s->conf->ssid; ssid; ssid = ssid->next) {
+			if (wpas_network_disabled(wpa_s, ssid) ||
+			    ssid->ssid_len != bss->ssid_len ||
+			    os_memcmp(ssid->ssid, bss->ssid,
+				      bss->ssid_len) != 0)
+				continue;
+			wpas_connect_scan_add_freq(wpa_s, &bm, bss->freq);
+			break;
+		}
+	}
+
+#ifdef CONFIG_WNM
+	for (i = 0; i < wpa_s->wnm_num_neighbor_report; i++)
+		wpas_connect_scan_add_freq(
+			wpa_s, &bm, wpa_s->wnm_neighbor_report_elements[i].freq);
+#endif /* CONFIG_WNM */
+
+	count = wpas_chan_bitmap_count(&bm);
+	if (count > WPAS_CONNECT_SCAN_MAX_PREDICTED) {
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"Too many likely channels (%u) - skip phase 1 connect scan",
+			count);
+		return NULL;
+	}
+
+	return wpas_chan_bitmap_to_list(&bm);
+}
+
+
+/**
+ * wpas_connect_scan_associated - Note the completion of a connection
+ * @wpa_s: Pointer to wpa_supplicant data
+ *
+ * This function is called from wpa_supplicant_set_state() when the interface
+ * enters WPA_COMPLETED. It records the association in the channel history
+ * and, if a two-phase connect scan was in progress, the time from its start
+ * to association and which phase found the network.
+ */
+void wpas_connect_scan_associated(struct wpa_supplicant *wpa_s)
+{
+	struct os_reltime now, diff;
+	struct wpas_chan_hist *hist;
+	struct wpas_chan_hist_entry *e = NULL;
+	struct os_time t;
+
+	hist = wpas_chan_hist_get(wpa_s);
+	if (hist && wpa_s->current_ssid)
+		e = wpas_chan_hist_entry_get(hist, wpa_s->current_ssid->ssid,
+					     wpa_s->current_ssid->ssid_len);
+	if (e) {
+		os_get_time(&t);
+		e->last_assoc = t.sec;
+		e->num_assoc++;
+		hist->dirty = 1;
+		wpas_chan_hist_add(hist, wpa_s->current_ssid->ssid,
+				   wpa_s->current_ssid->ssid_len,
+				   wpa_s->current_bss ?
+				   wpa_s->current_bss->freq :
+				   wpa_s->assoc_freq, t.sec);
+		wpas_chan_hist_schedule_save(wpa_s, hist);
+	}
+
+	if (!wpa_s->connect_scan_phase)
+		return;
+
+	os_get_reltime(&now);
+	os_reltime_sub(&now, &wpa_s->connect_scan_start, &diff);
+	if (wpa_s->connect_scan_phase == 1)
+		wpa_s->connect_scan_phase1_hits++;
+	else
+		wpa_s->connect_scan_phase2_hits++;
+	wpa_dbg(wpa_s, MSG_DEBUG,
+		"Connect scan: time_to_associate_ms=%ld phase=%d scans_until_found=%u (phase1_hits=%u phase2_hits=%u)",
+		diff.sec * 1000 + diff.usec / 1000, wpa_s->connect_scan_phase,
+		wpa_s->connect_scan_count, wpa_s->connect_scan_phase1_hits,
+		wpa_s->connect_scan_phase2_hits);
+	wpa_s->connect_scan_phase = 0;
+	wpa_s->connect_scan_count = 0;
+}
+
+
+/**
+ * wpas_connect_scan_disconnected - Note the loss of a connection
+ * @wpa_s: Pointer to wpa_supplicant data
+ *
+ * This function is called from the disconnection and deauthentication event
+ * handlers. The next connect scan then starts over with phase 1 and measures
+ * the time to associate from its own start.
+ */
+void wpas_connect_scan_disconnected(struct wpa_supplicant *wpa_s)
+{
+	wpa_s->connect_scan_phase = 0;
+	wpa_s->connect_scan_count = 0;
+}
+
+
+/* Save and free the channel history */
+static void wpas_chan_hist_deinit(struct wpa_supplicant *wpa_s)
+{
+	eloop_cancel_timeout(wpas_chan_hist_save_timeout, wpa_s, NULL);
+	if (!wpa_s->chan_hist)
+		return;
+
+	wpas_chan_hist_save(wpa_s, wpa_s->chan_hist);
+	os_free(wpa_s->chan_hist);
+	wpa_s->chan_hist = NULL;
+}
+
+
+static int wpas_ssid_needs_batch_probe(struct wpa_ssid *ssid)
+{
+	size_t i;
+
+#ifdef CONFIG_OWE
+	if (ssid->key_mgmt & WPA_KEY_MGMT_OWE)
+		return 1;
+#endif /* CONFIG_OWE */
+
+	for (i = 0; i < ssid->ssid_len; i++) {
+		if (ssid->ssid[i] < 0x20 || ssid->ssid[i] >= 0x7f)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Request a scan for the next batch of hidden OWE/non-ASCII SSIDs starting at
+ * batch_probe_pos. Returns 1 if a scan was requested, 0 if all batches have
+ * been requested, or -1 on failure.
+ */
+static int wpas_scan_batch_probe_next(struct wpa_supplicant *wpa_s)
+{
+	struct wpa_driver_scan_params params;
+	struct wpa_ssid *ssid;
+	struct wpabuf *extra_ie;
+	size_t i, max_ssids;
+	int ret;
+
+	max_ssids = wpa_s->max_scan_ssids;
+	if (max_ssids > WPAS_MAX_SCAN_SSIDS)
+		max_ssids = WPAS_MAX_SCAN_SSIDS;
+	if (max_ssids < 1)
+		max_ssids = 1;
+
+	os_memset(&params, 0, sizeof(params));
+	/* batch_probe_pos is the position in the network list */
+	for (i = 0, ssid = wpa_s->conf->ssid;
+	     ssid && i < wpa_s->batch_probe_pos; ssid = ssid->next)
+		i++;
+	for (; ssid && params.num_ssids < max_ssids; ssid = ssid->next, i++) {
+		if (wpas_network_disabled(wpa_s, ssid) || !ssid->scan_ssid ||
+		    !ssid->ssid_len || !wpas_ssid_needs_batch_probe(ssid))
+			continue;
+		wpa_hexdump_ascii(MSG_DEBUG, "Batch probe SSID",
+				  ssid->ssid, ssid->ssid_len);
+		params.ssids[params.num_ssids].ssid = ssid->ssid;
+		params.ssids[params.num_ssids].ssid_len = ssid->ssid_len;
+		params.num_ssids++;
+	}
+
+	if (params.num_ssids == 0) {
+		wpa_s->batch_probe_pos = 0;
+		wpa_s->batch_probe_active = 0;
+		return 0;
+	}
+
+	extra_ie = wpa_supplicant_extra_ies(wpa_s);
+	if (extra_ie) {
+		params.extra_ies = wpabuf_head(extra_ie);
+		params.extra_ies_len = wpabuf_len(extra_ie);
+	}
+	ret = wpa_supplicant_trigger_scan(wpa_s, &params);
+	wpabuf_free(extra_ie);
+	if (ret < 0)
+		return -1;
+
+	wpa_dbg(wpa_s, MSG_DEBUG,
+		"Requested batched scan for %u hidden OWE/non-ASCII SSID(s)",
+		(unsigned int) params.num_ssids);
+	wpa_s->batch_probe_pos = i;
+	return 1;
+}
+
+
+/**
+ * wpas_scan_owe_and_non_ascii - Probe hidden OWE and non-ASCII SSIDs
+ * @wpa_s: Pointer to wpa_supplicant data
+ * Returns: 1 if a scan was requested, 0 if no network needs one, or -1 on
+ * failure
+ *
+ * This function requests active scans for the enabled hidden (scan_ssid=1)
+ * networks that use OWE or have an SSID with non-printable/non-ASCII octets.
+ * The SSIDs are packed into as few scan requests as max_scan_ssids allows.
+ * Each batch goes through wpa_supplicant_trigger_scan(), so it may be merged
+ * into a pending scan. The next batch is requested when scan results are
+ * received; a batch that could not be requested is retried then.
+ */
+int wpas_scan_owe_and_non_ascii(struct wpa_supplicant *wpa_s)
+{
+	wpa_s->batch_probe_pos = 0;
+	wpa_s->batch_probe_active = 1;
+	return wpas_scan_batch_probe_next(wpa_s);
+}
+
+
+/* Find an enabled network whose SSID matches the scan result */
+static struct wpa_ssid *
+wpas_scan_res_enabled_network(const struct wpas_network_set *networks,
+			      struct wpa_scan_res *res)
+{
+	const u8 *ie;
+
+	ie = wpa_scan_get_ie(res, WLAN_EID_SSID);
+	if (!ie)
+		return NULL;
+
+	return wpas_network_set_get(networks, ie + 2, ie[1]);
+}
+
+
+/*
+ * Find a BSS of an enabled network with at least scan_early_abort_snr that is
+ * not the current BSS. Returns the network or %NULL if there is none.
+ */
+static struct wpa_ssid *
+wpas_scan_early_candidate(struct wpa_supplicant *wpa_s,
+			  const struct wpas_network_set *networks,
+			  struct wpa_scan_results *scan_res)
+{
+	struct wpa_ssid *ssid;
+	size_t i;
+
+	for (i = 0; i < scan_res->num; i++) {
+		struct wpa_scan_res *res = scan_res->res[i];
+
+		if (!(res->flags & WPA_SCAN_LEVEL_DBM))
+			continue;
+		if (wpa_s->current_bss &&
+		    os_memcmp(res->bssid, wpa_s->current_bss->bssid,
+			      ETH_ALEN) == 0)
+			continue;
+		scan_snr(res);
+		if (res->snr < wpa_s->conf->scan_early_abort_snr)
+			continue;
+		ssid = wpas_scan_res_enabled_network(networks, res);
+		if (ssid) {
+			wpa_dbg(wpa_s, MSG_DEBUG,
+				"Early scan candidate: " MACSTR
+				" (SSID %s) freq=%d snr=%d",
+				MAC2STR(res->bssid),
+				wpa_ssid_txt(ssid->ssid, ssid->ssid_len),
+				res->freq, res->snr);
+			return ssid;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Chunked scans
+ *
+ * While associated, a full scan keeps the radio off the operating channel for
+ * the whole sweep. When scan_chunk_channels is set, such background scans are
+ * split into groups of that many channels. Each group is a separate low
+ * priority scan work item, the next one is started scan_chunk_gap_ms after the
+ * results of the previous one have been merged into the BSS table. Only the
+ * results of the scan work that covered the current chunk advance the sweep;
+ * results of other scans in between are ignored here. With
+ * scan_early_abort_snr set, the remaining chunks are skipped once a chunk has
+ * found a roaming candidate with at least that SNR.
+ *
+ * With scan_early_abort_snr set, scans for a connection (not associated) are
+ * chunked, too, so that a strong candidate found on the first channels ends
+ * the sweep. Such chunks use normal priority and no gap. The results of a
+ * chunk without a candidate of at least scan_early_abort_snr are only
+ * reported (scan_only_handler()) and the connection decision waits for the
+ * chunk that finds one or for the last chunk. Since the driver returns its
+ * whole scan result cache, that decision sees the BSSs of all chunks.
+ */
+
+/* Upper limit for scan_chunk_channels */
+#define WPAS_SCAN_CHUNK_MAX 16
+/* Chunk size for connect scans if scan_chunk_channels is not set */
+#define WPAS_SCAN_CONNECT_CHUNK 4
+
+static void wpas_scan_chunk_timeout(void *eloop_ctx, void *timeout_ctx);
+
+
+static void wpas_scan_chunks_free(struct wpa_supplicant *wpa_s)
+{
+	if (!wpa_s->scan_chunk_params)
+		return;
+	eloop_cancel_timeout(wpas_scan_chunk_timeout, wpa_s, NULL);
+	wpa_scan_free_params(wpa_s->scan_chunk_params);
+	wpa_s->scan_chunk_params = NULL;
+	wpa_s->scan_chunk_pos = 0;
+	wpa_s->scan_chunk_req = NULL;
+	wpa_s->scan_chunk_work = NULL;
+	wpa_s->scan_chunk_connect = 0;
+}
+
+
+/* Number of channels per chunk */
+static int wpas_scan_chunk_size(struct wpa_supplicant *wpa_s, int connect)
+{
+	int size = wpa_s->conf->scan_chunk_channels;
+
+	if (size <= 0)
+		size = connect ? WPAS_SCAN_CONNECT_CHUNK : 0;
+	return size > WPAS_SCAN_CHUNK_MAX ? WPAS_SCAN_CHUNK_MAX : size;
+}
+
+
+/* Trigger the next chunk of a chunked scan */
+static int wpas_scan_chunk_trigger(struct wpa_supplicant *wpa_s)
+{
+	struct wpa_driver_scan_params *params = wpa_s->scan_chunk_params;
+	int *all_freqs = params->freqs;
+	int chunk[WPAS_SCAN_CHUNK_MAX + 1];
+	int i, size, ret;
+
+	size = wpas_scan_chunk_size(wpa_s, wpa_s->scan_chunk_connect);
+	for (i = 0; i < size && all_freqs[wpa_s->scan_chunk_pos]; i++)
+		chunk[i] = all_freqs[wpa_s->scan_chunk_pos++];
+	chunk[i] = 0;
+
+	wpa_dbg(wpa_s, MSG_DEBUG,
+		"%s scan chunk: %d channels starting at %d MHz",
+		wpa_s->scan_chunk_connect ? "Connect" : "Background",
+		i, chunk[0]);
+	params->freqs = chunk;
+	ret = wpa_supplicant_trigger_scan(wpa_s, params);
+	params->freqs = all_freqs;
+	if (ret == 0) {
+		/* Scan work (new or merged into) that covers this chunk */
+		wpa_s->scan_chunk_req = wpa_s->pending_scan_params;
+	}
+
+	return ret;
+}
+
+
+static void wpas_scan_chunk_timeout(void *eloop_ctx, void *timeout_ctx)
+{
+	struct wpa_supplicant *wpa_s = eloop_ctx;
+
+	if (!wpa_s->scan_chunk_params)
+		return;
+
+	if (wpa_s->scan_chunk_connect && wpa_s->wpa_state > WPA_SCANNING) {
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"Connection started - stop chunked connect scan");
+		wpas_scan_chunks_free(wpa_s);
+		return;
+	}
+	if (!wpa_s->scan_chunk_connect && wpa_s->wpa_state != WPA_COMPLETED) {
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"Not associated anymore - stop chunked background scan");
+		wpas_scan_chunks_free(wpa_s);
+		return;
+	}
+
+	if (wpas_scan_chunk_trigger(wpa_s) < 0) {
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"Failed to trigger background scan chunk - stop chunked scan");
+		wpas_scan_chunks_free(wpa_s);
+	}
+}
+
+
+/*
+ * Called when scan results are received to continue a chunked scan. This runs
+ * before the results are dispatched, so a chunk of a connect scan can still
+ * hold back the connection decision.
+ */
+static void wpas_scan_chunk_done(struct wpa_supplicant *wpa_s,
+				 const struct wpas_network_set *networks,
+				 struct wpa_scan_results *scan_res)
+{
+	int gap;
+
+	if (!wpa_s->scan_chunk_params || !wpa_s->scan_chunk_work ||
+	    wpa_s->scan_work != wpa_s->scan_chunk_work)
+		return; /* not the results of the current chunk */
+	wpa_s->scan_chunk_work = NULL;
+
+	if (!wpa_s->scan_chunk_params->freqs[wpa_s->scan_chunk_pos]) {
+		wpa_dbg(wpa_s, MSG_DEBUG, "Chunked scan completed");
+		wpas_scan_chunks_free(wpa_s);
+		return;
+	}
+
+	if (wpa_s->conf->scan_early_abort_snr &&
+	    wpas_scan_early_candidate(wpa_s, networks, scan_res)) {
+		wpa_dbg(wpa_s, MSG_DEBUG, "Skip the remaining scan chunks");
+		wpas_scan_chunks_free(wpa_s);
+		wpa_s->scan_early_aborts++;
 		return;
 	}
 
-	params->freqs = os_calloc(mode->num_channels + 1, sizeof(int));
-	if (params->freqs == NULL)
+	if (wpa_s->scan_chunk_connect) {
+		/* Wait for the other chunks before deciding on a network */
+		if (!wpa_s->scan_res_handler)
+			wpa_s->scan_res_handler = scan_only_handler;
+		eloop_register_timeout(0, 0, wpas_scan_chunk_timeout, wpa_s,
+				       NULL);
 		return;
-	for (count = 0, i = 0; i < mode->num_channels; i++) {
-		if (mode->channels[i].flag & HOSTAPD_CHAN_DISABLED)
-			continue;
-		params->freqs[count++] = mode->channels[i].freq;
 	}
+
+	gap = wpa_s->conf->scan_chunk_gap_ms;
+	eloop_register_timeout(gap / 1000, (gap % 1000) * 1000,
+			       wpas_scan_chunk_timeout, wpa_s, NULL);
 }
 
 
-static void wpa_setband_scan_freqs(struct wpa_supplicant *wpa_s,
-				   struct wpa_driver_scan_params *params)
+/* Add all channels enabled in the driver */
+static void wpas_scan_all_freqs(struct wpa_supplicant *wpa_s,
+				struct wpas_chan_bitmap *bm)
 {
-	if (wpa_s->hw.modes == NULL)
-		return; /* unknown what channels the driver supports */
-	if (params->freqs)
-		return; /* already using a limited channel set */
-	if (wpa_s->setband == WPA_SETBAND_5G)
-		wpa_setband_scan_freqs_list(wpa_s, HOSTAPD_MODE_IEEE80211A,
-					    params);
-	else if (wpa_s->setband == WPA_SETBAND_2G)
-		wpa_setband_scan_freqs_list(wpa_s, HOSTAPD_MODE_IEEE80211G,
-					    params);
+	struct hostapd_hw_modes *mode;
+	int i, j;
+
+	for (i = 0; wpa_s->hw.modes && i < wpa_s->hw.num_modes; i++) {
+		mode = &wpa_s->hw.modes[i];
+		for (j = 0; j < mode->num_channels; j++) {
+			if (mode->channels[j].flag & HOSTAPD_CHAN_DISABLED)
+				continue;
+			wpas_chan_bitmap_add(bm, mode->channels[j].freq);
+		}
+	}
 }
 
 
-static void wpa_set_scan_ssids(struct wpa_supplicant *wpa_s,
-			       struct wpa_driver_scan_params *params,
-			       size_t max_ssids)
+/* BSS table entries older than this (seconds) are refreshed */
+#define WPAS_SCAN_CACHE_MAX_AGE 60
+
+/*
+ * Channels for a background scan that refreshes the BSS table: the channels a
+ * full scan would cover, except those on which every BSS table entry has been
+ * updated within WPAS_SCAN_CACHE_MAX_AGE seconds, e.g., by a partial or
+ * chunked scan. Channels without entries are kept, since a recent scan of them
+ * cannot be told from none. Returns %NULL for a full scan if no channel is
+ * skipped.
+ */
+static int * wpas_scan_refresh_stale(struct wpa_supplicant *wpa_s)
 {
-	unsigned int i;
-	struct wpa_ssid *ssid;
+	struct wpa_bss *bss;
+	struct os_reltime now;
+	struct wpas_chan_bitmap fresh, stale, bm, refresh;
+	unsigned int i, skipped = 0;
+	int bit, freq;
+
+	wpas_chan_bitmap_init(&fresh);
+	wpas_chan_bitmap_init(&stale);
+	os_get_reltime(&now);
+	dl_list_for_each(bss, &wpa_s->bss, struct wpa_bss, list) {
+		if (os_reltime_expired(&now, &bss->last_update,
+				       WPAS_SCAN_CACHE_MAX_AGE))
+			wpas_chan_bitmap_add(&stale, bss->freq);
+		else
+			wpas_chan_bitmap_add(&fresh, bss->freq);
+	}
+	for (i = 0; i < WPAS_CHAN_BITMAP_WORDS; i++)
+		fresh.bits[i] &= ~stale.bits[i];
+	fresh.num_other = 0;
+	if (!wpas_chan_bitmap_count(&fresh))
+		return NULL;
 
-	for (i = 0; i < wpa_s->scan_id_count; i++) {
-		unsigned int j;
+	wpas_chan_bitmap_init(&bm);
+	wpas_scan_all_freqs(wpa_s, &bm);
+	if (wpa_s->conf->scan_6ghz_psc)
+		wpas_scan_6ghz_filter(wpa_s, &bm);
 
-		ssid = wpa_config_get_network(wpa_s->conf, wpa_s->scan_id[i]);
-		if (!ssid || !ssid->scan_ssid)
+	wpas_chan_bitmap_init(&refresh);
+	for (bit = 0; bit < WPAS_CHAN_BITMAP_BITS; bit++) {
+		if (!(bm.bits[bit / 32] & BIT(bit % 32)))
 			continue;
+		freq = wpas_chan_bitmap_freq(bit);
+		if (!wpas_scan_freq_allowed(wpa_s, freq))
+			continue;
+		if (fresh.bits[bit / 32] & BIT(bit % 32))
+			skipped++;
+		else
+			wpas_chan_bitmap_add(&refresh, freq);
+	}
+	for (i = 0; i < bm.num_other; i++) {
+		if (wpas_scan_freq_allowed(wpa_s, bm.other[i]))
+			wpas_chan_bitmap_add(&refresh, bm.other[i]);
+	}
+	if (!skipped || !wpas_chan_bitmap_count(&refresh))
+		return NULL;
 
-		for (j = 0; j < params->num_ssids; j++) {
-			if (params->ssids[j].ssid_len == ssid->ssid_len &&
-			    params->ssids[j].ssid &&
-			    os_memcmp(params->ssids[j].ssid, ssid->ssid,
-				      ssid->ssid_len) == 0)
-				break;
-		}
-		if (j < params->num_ssids)
-			continue; /* already in the list */
+	wpa_dbg(wpa_s, MSG_DEBUG,
+		"Refresh %u channel(s), skip %u with fresh BSS table entries",
+		wpas_chan_bitmap_count(&refresh), skipped);
+	return wpas_chan_bitmap_to_list(&refresh);
+}
 
-		if (params->num_ssids + 1 > max_ssids) {
-			wpa_printf(MSG_DEBUG,
-				   "Over max scan SSIDs for manual request");
-			break;
-		}
 
-		wpa_printf(MSG_DEBUG, "Scan SSID (manual request): %s",
-			   wpa_ssid_txt(ssid->ssid, ssid->ssid_len));
-		params->ssids[params->num_ssids].ssid = ssid->ssid;
-		params->ssids[params->num_ssids].ssid_len = ssid->ssid_len;
-		params->num_ssids++;
-	}
+/*
+ * Replace a scan of all channels with the enabled channels outside the 6 GHz
+ * band, the 6 GHz PSCs and the RNR advertised 6 GHz channels.
+ */
+static void wpas_scan_6ghz_discovery(struct wpa_supplicant *wpa_s,
+				     struct wpa_driver_scan_params *params)
+{
+	struct wpas_chan_bitmap bm;
 
-	wpa_s->scan_id_count = 0;
+	if (!wpa_s->conf->scan_6ghz_psc || params->freqs || !wpa_s->hw.modes)
+		return;
+
+	wpas_chan_bitmap_init(&bm);
+	wpas_scan_all_freqs(wpa_s, &bm);
+	if (!wpas_scan_6ghz_filter(wpa_s, &bm))
+		return; /* nothing to skip - keep scanning all channels */
+	params->freqs = wpas_chan_bitmap_to_list(&bm);
 }
 
 
-static int wpa_set_ssids_from_scan_req(struct wpa_supplicant *wpa_s,
-				       struct wpa_driver_scan_params *params,
-				       size_t max_ssids)
+/*
+ * Start a chunked background or connect scan if configured and the request
+ * qualifies. Returns 1 if the scan request was handled (the result of the
+ * first chunk trigger is stored in @ret), 0 if a normal scan should be used.
+ */
+static int wpas_scan_start_chunked(struct wpa_supplicant *wpa_s,
+				   struct wpa_driver_scan_params *params,
+				   int *ret)
 {
-	unsigned int i;
+	struct wpa_driver_scan_params *chunk_params;
+	struct wpas_chan_bitmap bm, req;
+	int *freqs, connect, size;
 
-	if (wpa_s->ssids_from_scan_req == NULL ||
-	    wpa_s->num_ssids_from_scan_req == 0)
+	if (wpa_s->last_scan_req != NORMAL_SCAN_REQ)
+		return 0;
+	if (wpa_s->wpa_state == WPA_COMPLETED)
+		connect = 0;
+	else if (wpa_s->wpa_state < WPA_ASSOCIATED &&
+		 wpa_s->conf->scan_early_abort_snr)
+		connect = 1;
+	else
+		return 0;
+	size = wpas_scan_chunk_size(wpa_s, connect);
+	if (size <= 0)
 		return 0;
 
-	if (wpa_s->num_ssids_from_scan_req > max_ssids) {
-		wpa_s->num_ssids_from_scan_req = max_ssids;
-		wpa_printf(MSG_DEBUG, "Over max scan SSIDs from scan req: %u",
-			   (unsigned int) max_ssids);
+	if (wpa_s->scan_chunk_params) {
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"Chunked background scan already in progress");
+		*ret = 0;
+		return 1;
 	}
 
-	for (i = 0; i < wpa_s->num_ssids_from_scan_req; i++) {
-		params->ssids[i].ssid = wpa_s->ssids_from_scan_req[i].ssid;
-		params->ssids[i].ssid_len =
-			wpa_s->ssids_from_scan_req[i].ssid_len;
-		wpa_hexdump_ascii(MSG_DEBUG, "specific SSID",
-				  params->ssids[i].ssid,
-				  params->ssids[i].ssid_len);
+	/* Do not spend chunks on requested channels the driver has disabled */
+	wpas_chan_bitmap_init(&bm);
+	wpas_scan_all_freqs(wpa_s, &bm);
+	if (params->freqs) {
+		wpas_chan_bitmap_init(&req);
+		if (wpas_chan_bitmap_add_list(&req, params->freqs) < 0)
+			return 0;
+		wpas_chan_bitmap_intersect(&bm, &req);
 	}
+	if (wpas_chan_bitmap_count(&bm) <= (unsigned int) size)
+		return 0;
+	freqs = wpas_chan_bitmap_to_list(&bm);
+	if (!freqs)
+		return 0;
+
+	chunk_params = wpa_scan_clone_params(params);
+	if (!chunk_params) {
+		os_free(freqs);
+		return 0;
+	}
+	os_free(chunk_params->freqs);
+	chunk_params->freqs = freqs;
+	chunk_params->low_priority = !connect;
+	/* Later chunks rely on the driver keeping the earlier results */
+	chunk_params->only_new_results = 0;
+
+	wpa_dbg(wpa_s, MSG_DEBUG,
+		"Split %s scan of %d channels into chunks of %d",
+		connect ? "connect" : "background", int_array_len(freqs), size);
+	wpa_s->scan_chunk_params = chunk_params;
+	wpa_s->scan_chunk_pos = 0;
+	wpa_s->scan_chunk_connect = connect;
+	*ret = wpas_scan_chunk_trigger(wpa_s);
+	if (*ret < 0)
+		wpas_scan_chunks_free(wpa_s);
 
-	params->num_ssids = wpa_s->num_ssids_from_scan_req;
-	wpa_s->num_ssids_from_scan_req = 0;
 	return 1;
 }
 
@@ -910,12 +3338,38 @@ static void wpa_supplicant_scan(void *eloop_ctx, void *timeout_ctx)
 		wpa_s->reattach = 0;
 	} else {
 		struct wpa_ssid *start = ssid, *tssid;
-		int freqs_set = 0;
+		struct wpa_ssid *ranked[WPAS_MAX_SCAN_SSIDS];
+		size_t j, num_ranked = 0;
+		struct wpas_chan_bitmap scan_freqs;
+		int freqs_all = 0;
+
+		/*
+		 * If not all SSIDs fit into the request, probe the networks
+		 * most likely to be nearby first and keep at least one entry
+		 * for the rotation so that the others are not starved.
+		 */
+		if (max_ssids > 2)
+			num_ranked = wpas_scan_ssid_rank(wpa_s, max_ssids,
+							 ranked);
+		for (j = 0; j < num_ranked; j++) {
+			tssid = ranked[j];
+			wpa_hexdump_ascii(MSG_DEBUG, "Scan SSID (ranked)",
+					  tssid->ssid, tssid->ssid_len);
+			params.ssids[params.num_ssids].ssid = tssid->ssid;
+			params.ssids[params.num_ssids].ssid_len =
+				tssid->ssid_len;
+			params.num_ssids++;
+		}
+
 		if (ssid == NULL && max_ssids > 1)
 			ssid = wpa_s->conf->ssid;
 		while (ssid) {
+			for (j = 0; j < num_ranked; j++) {
+				if (ranked[j] == ssid)
+					break;
+			}
 			if (!wpas_network_disabled(wpa_s, ssid) &&
-			    ssid->scan_ssid) {
+			    ssid->scan_ssid && j == num_ranked) {
 				wpa_hexdump_ascii(MSG_DEBUG, "Scan SSID",
 						  ssid->ssid, ssid->ssid_len);
 				params.ssids[params.num_ssids].ssid =
@@ -938,21 +3392,26 @@ static void wpa_supplicant_scan(void *eloop_ctx, void *timeout_ctx)
 		    wpa_s->last_scan_req == MANUAL_SCAN_REQ)
 			wpa_set_scan_ssids(wpa_s, &params, max_ssids);
 
+		/*
+		 * Scan only the union of the configured scan_freq lists, unless
+		 * an enabled network has none, in which case all channels are
+		 * scanned.
+		 */
+		wpas_chan_bitmap_init(&scan_freqs);
 		for (tssid = wpa_s->conf->ssid;
 		     wpa_s->last_scan_req != MANUAL_SCAN_REQ && tssid;
 		     tssid = tssid->next) {
 			if (wpas_network_disabled(wpa_s, tssid))
 				continue;
-			if ((params.freqs || !freqs_set) && tssid->scan_freq) {
-				int_array_concat(&params.freqs,
-						 tssid->scan_freq);
-			} else {
-				os_free(params.freqs);
-				params.freqs = NULL;
+			if (!tssid->scan_freq ||
+			    wpas_chan_bitmap_add_list(&scan_freqs,
+						      tssid->scan_freq) < 0) {
+				freqs_all = 1;
+				break;
 			}
-			freqs_set = 1;
 		}
-		int_array_sort_unique(params.freqs);
+		if (!freqs_all)
+			params.freqs = wpas_chan_bitmap_to_list(&scan_freqs);
 	}
 
 	if (ssid && max_ssids == 1) {
@@ -1019,6 +3478,45 @@ ssid_list_set:
 	} else
 		os_free(wpa_s->next_scan_freqs);
 	wpa_s->next_scan_freqs = NULL;
+
+	/*
+	 * Two-phase connect scan: when looking for a network to connect to,
+	 * first scan only the channels where enabled networks are likely to
+	 * be found. If that does not result in a connection, the next scan is
+	 * a full sweep.
+	 */
+	if (wpa_s->wpa_state == WPA_COMPLETED) {
+		wpa_s->connect_scan_phase = 0;
+		wpa_s->connect_scan_count = 0;
+		/* Background scan: skip channels refreshed recently */
+		if (params.freqs == NULL &&
+		    wpa_s->last_scan_req == NORMAL_SCAN_REQ)
+			params.freqs = wpas_scan_refresh_stale(wpa_s);
+	} else if (wpa_s->last_scan_req == NORMAL_SCAN_REQ) {
+		wpa_s->connect_scan_count++;
+	}
+	if (wpa_s->wpa_state != WPA_COMPLETED && params.freqs == NULL &&
+	    wpa_s->last_scan_req == NORMAL_SCAN_REQ) {
+		if (wpa_s->connect_scan_phase == 0) {
+			os_get_reltime(&wpa_s->connect_scan_start);
+			params.freqs = wpas_connect_scan_predict_freqs(wpa_s);
+			if (params.freqs) {
+				wpa_s->connect_scan_phase = 1;
+				wpa_dbg(wpa_s, MSG_DEBUG,
+					"Connect scan phase 1: scan %d likely channels",
+					int_array_len(params.freqs));
+			} else {
+				/* Nothing to predict - this is a full scan */
+				wpa_s->connect_scan_phase = 2;
+				wpa_dbg(wpa_s, MSG_DEBUG,
+					"Connect scan phase 2: no likely channels - full scan");
+			}
+		} else if (wpa_s->connect_scan_phase == 1) {
+			wpa_s->connect_scan_phase = 2;
+			wpa_dbg(wpa_s, MSG_DEBUG,
+				"Connect scan phase 2: full scan");
+		}
+	}
 	wpa_setband_scan_freqs(wpa_s, &params);
 
 	/* See if user specified frequencies. If so, scan only those. */
@@ -1089,69 +3587,371 @@ ssid_list_set:
 		}
 	}
 
-	scan_params = &params;
+	scan_params = &params;
+
+scan:
+#ifdef CONFIG_P2P
+	/*
+	 * If the driver does not support multi-channel concurrency and a
+	 * virtual interface that shares the same radio with the wpa_s interface
+	 * is operating there may not be need to scan other channels apart from
+	 * the current operating channel on the other virtual interface. Filter
+	 * out other channels in case we are trying to find a connection for a
+	 * station interface when we are not configured to prefer station
+	 * connection and a concurrent operation is already in process.
+	 */
+	if (wpa_s->scan_for_connection &&
+	    wpa_s->last_scan_req == NORMAL_SCAN_REQ &&
+	    !scan_params->freqs && !params.freqs &&
+	    wpas_is_p2p_prioritized(wpa_s) &&
+	    wpa_s->p2p_group_interface == NOT_P2P_GROUP_INTERFACE &&
+	    non_p2p_network_enabled(wpa_s)) {
+		unsigned int num = wpa_s->num_multichan_concurrent;
+
+		params.freqs = os_calloc(num + 1, sizeof(int));
+		if (params.freqs) {
+			num = get_shared_radio_freqs(wpa_s, params.freqs, num);
+			if (num > 0 && num == wpa_s->num_multichan_concurrent) {
+				wpa_dbg(wpa_s, MSG_DEBUG, "Scan only the current operating channels since all channels are already used");
+			} else {
+				os_free(params.freqs);
+				params.freqs = NULL;
+			}
+		}
+	}
+#endif /* CONFIG_P2P */
+
+	if (scan_params == &params)
+		wpas_scan_6ghz_discovery(wpa_s, &params);
+
+	if (!wpas_scan_start_chunked(wpa_s, scan_params, &ret))
+		ret = wpa_supplicant_trigger_scan(wpa_s, scan_params);
+
+	if (ret && wpa_s->last_scan_req == MANUAL_SCAN_REQ && params.freqs &&
+	    !wpa_s->manual_scan_freqs) {
+		/* Restore manual_scan_freqs for the next attempt */
+		wpa_s->manual_scan_freqs = params.freqs;
+		params.freqs = NULL;
+	}
+
+	wpabuf_free(extra_ie);
+	os_free(params.freqs);
+	os_free(params.filter_ssids);
+
+	if (ret) {
+		wpa_msg(wpa_s, MSG_WARNING, "Failed to initiate AP scan");
+		if (wpa_s->scan_prev_wpa_state != wpa_s->wpa_state)
+			wpa_supplicant_set_state(wpa_s,
+						 wpa_s->scan_prev_wpa_state);
+		/* Restore scan_req since we will try to scan again */
+		wpa_s->scan_req = wpa_s->last_scan_req;
+		wpa_supplicant_req_scan_retry(wpa_s);
+	} else {
+		wpa_s->scan_for_connection = 0;
+		/* Probe hidden OWE/non-ASCII networks once per attempt */
+		if (wpa_s->connect_scan_count == 1)
+			wpas_scan_owe_and_non_ascii(wpa_s);
+#ifdef CONFIG_INTERWORKING
+		wpa_s->interworking_fast_assoc_tried = 0;
+#endif /* CONFIG_INTERWORKING */
+		if (params.bssid)
+			os_memset(wpa_s->next_scan_bssid, 0, ETH_ALEN);
+	}
+}
+
+
+/*
+ * Adaptive scan interval
+ *
+ * With adaptive_scan_interval enabled, each set of new scan results is used to
+ * estimate whether the device is moving: a large change in the current BSS
+ * signal level or in the set of visible BSSes shortens the scan interval,
+ * while consecutive unchanged scans lengthen it step by step. When a bgscan
+ * module is active for the current network, it owns the background scan
+ * intervals and no adaptation is done.
+ *
+ * Scans do not all cover the same channels (single channel, chunked and
+ * partial scans), so the BSS sets are only compared on the channels that both
+ * the previous and the current scan covered. Results of scans with unknown
+ * channels are only used for the current BSS signal level.
+ */
+
+/* Change in current BSS signal level (dB) that indicates movement */
+#define WPAS_ADAPTIVE_RSSI_DELTA 6
+/* Percentage of changed BSSes between scans that indicates movement */
+#define WPAS_ADAPTIVE_SET_CHANGE 30
+/* Stationary scan intervals grow up to 2^WPAS_ADAPTIVE_MAX_SHIFT times */
+#define WPAS_ADAPTIVE_MAX_SHIFT 3
+/* Limits for the adjusted scan interval (seconds) */
+#define WPAS_ADAPTIVE_MIN_INT 3
+#define WPAS_ADAPTIVE_MAX_INT 600
+/* Maximum number of BSSes remembered from the previous scan */
+#define WPAS_ADAPTIVE_MAX_BSS 128
+
+struct wpas_adaptive_scan {
+	int base_int;
+	/* Channels of the last scan and the BSSes seen on them */
+	struct wpas_chan_bitmap scanned;
+	int scanned_valid;
+	struct {
+		u16 chan; /* struct wpas_chan_bitmap bit */
+		u8 hash; /* hashed BSSID */
+	} bss[WPAS_ADAPTIVE_MAX_BSS];
+	unsigned int num_bss;
+	int last_level;
+	int last_level_valid;
+	int moving;
+	unsigned int stationary;
+	struct os_reltime last_periodic; /* last periodic scan results */
+	unsigned int scans_saved;
+	unsigned int extra_scans;
+};
+
+
+static int wpas_adaptive_scan_enabled(struct wpa_supplicant *wpa_s)
+{
+	if (!wpa_s->conf->adaptive_scan_interval)
+		return 0;
+#ifdef CONFIG_BGSCAN
+	if (wpa_s->bgscan_ssid)
+		return 0; /* bgscan controls the intervals */
+#endif /* CONFIG_BGSCAN */
+	return 1;
+}
+
+
+static unsigned int wpas_adaptive_popcount(u32 val)
+{
+	unsigned int count = 0;
+
+	while (val) {
+		val &= val - 1;
+		count++;
+	}
+
+	return count;
+}
+
+
+/* Adjust a scan interval (in seconds) based on the estimated mobility */
+static int wpas_adaptive_scan_int(struct wpa_supplicant *wpa_s, int sec)
+{
+	struct wpas_adaptive_scan *st = wpa_s->adaptive_scan;
+	unsigned int shift;
+	int adj;
+
+	if (!st || !wpas_adaptive_scan_enabled(wpa_s) || sec <= 0)
+		return sec;
+
+	if (st->moving) {
+		adj = sec / 2;
+		if (adj < WPAS_ADAPTIVE_MIN_INT)
+			adj = WPAS_ADAPTIVE_MIN_INT;
+		return adj < sec ? adj : sec;
+	}
+
+	shift = st->stationary;
+	if (shift > WPAS_ADAPTIVE_MAX_SHIFT)
+		shift = WPAS_ADAPTIVE_MAX_SHIFT;
+	adj = sec << shift;
+	if (adj > WPAS_ADAPTIVE_MAX_INT)
+		adj = WPAS_ADAPTIVE_MAX_INT;
+	return adj > sec ? adj : sec;
+}
+
+
+static u8 wpas_adaptive_bssid_hash(const u8 *bssid)
+{
+	return bssid[3] ^ bssid[4] ^ bssid[5];
+}
+
+
+/*
+ * Compare the BSSes of the new scan results with those of the previous scan on
+ * the channels both scans covered and remember the new ones. Sets @changed and
+ * @total to the number of differing and all hashed BSSIDs compared. Returns 1
+ * if there was anything to compare.
+ */
+static int wpas_adaptive_compare_bss(struct wpas_adaptive_scan *st,
+				     struct wpa_scan_results *scan_res,
+				     const struct wpas_chan_bitmap *scanned,
+				     unsigned int *changed,
+				     unsigned int *total)
+{
+	struct wpas_chan_bitmap common;
+	u32 cur_set[8], prev_set[8];
+	unsigned int i;
+	int bit, compare;
+
+	*changed = *total = 0;
+	common = *scanned;
+	if (st->scanned_valid)
+		wpas_chan_bitmap_intersect(&common, &st->scanned);
+	compare = st->scanned_valid && wpas_chan_bitmap_count(&common);
+
+	os_memset(cur_set, 0, sizeof(cur_set));
+	os_memset(prev_set, 0, sizeof(prev_set));
+	for (i = 0; compare && i < st->num_bss; i++) {
+		u8 h = st->bss[i].hash;
+
+		if (common.bits[st->bss[i].chan / 32] &
+		    BIT(st->bss[i].chan % 32))
+			prev_set[h / 32] |= BIT(h % 32);
+	}
+
+	st->num_bss = 0;
+	for (i = 0; i < scan_res->num; i++) {
+		struct wpa_scan_res *res = scan_res->res[i];
+		u8 h = wpas_adaptive_bssid_hash(res->bssid);
+
+		bit = wpas_chan_bitmap_bit(res->freq);
+		if (bit < 0 || !wpas_chan_bitmap_test(scanned, res->freq))
+			continue;
+		if (compare && wpas_chan_bitmap_test(&common, res->freq))
+			cur_set[h / 32] |= BIT(h % 32);
+		if (st->num_bss < WPAS_ADAPTIVE_MAX_BSS) {
+			st->bss[st->num_bss].chan = bit;
+			st->bss[st->num_bss].hash = h;
+			st->num_bss++;
+		}
+	}
+	st->scanned = *scanned;
+	st->scanned_valid = 1;
+
+	for (i = 0; compare && i < ARRAY_SIZE(cur_set); i++) {
+		*changed += wpas_adaptive_popcount(cur_set[i] ^ prev_set[i]);
+		*total += wpas_adaptive_popcount(cur_set[i] | prev_set[i]);
+	}
+
+	return compare;
+}
+
+
+/* Update the mobility estimate from a new set of scan results */
+static void wpas_adaptive_scan_update(struct wpa_supplicant *wpa_s,
+				      struct wpa_scan_results *scan_res,
+				      struct scan_info *info)
+{
+	struct wpas_adaptive_scan *st;
+	struct wpas_chan_bitmap scanned;
+	unsigned int changed = 0, total = 0;
+	int level = 0, level_valid = 0, moving = 0, prev_int, cur_int;
+	int compared = 0;
+	struct os_reltime now, age;
+	size_t i;
+
+	if (!wpas_adaptive_scan_enabled(wpa_s))
+		return;
+
+	st = wpa_s->adaptive_scan;
+	if (!st) {
+		st = os_zalloc(sizeof(*st));
+		if (!st)
+			return;
+		st->base_int = wpa_s->scan_interval;
+		wpa_s->adaptive_scan = st;
+	}
+
+	for (i = 0; wpa_s->current_bss && i < scan_res->num; i++) {
+		struct wpa_scan_res *res = scan_res->res[i];
+
+		if (os_memcmp(res->bssid, wpa_s->current_bss->bssid,
+			      ETH_ALEN) == 0) {
+			level = res->level;
+			level_valid = 1;
+			break;
+		}
+	}
+
+	if (info && info->num_freqs) {
+		wpas_chan_bitmap_init(&scanned);
+		for (i = 0; i < info->num_freqs; i++)
+			wpas_chan_bitmap_add(&scanned, info->freqs[i]);
+		compared = wpas_adaptive_compare_bss(st, scan_res, &scanned,
+						     &changed, &total);
+	}
+
+	if (total && changed * 100 >= total * WPAS_ADAPTIVE_SET_CHANGE)
+		moving = 1;
+	if (level_valid && st->last_level_valid) {
+		compared = 1;
+		if (abs(level - st->last_level) >= WPAS_ADAPTIVE_RSSI_DELTA)
+			moving = 1;
+	}
+
+	/* Keep the last known level over scans that missed its channel */
+	if (level_valid) {
+		st->last_level = level;
+		st->last_level_valid = 1;
+	} else if (!wpa_s->current_bss) {
+		st->last_level_valid = 0;
+	}
+	if (!compared)
+		return;
+
+	prev_int = wpas_adaptive_scan_int(wpa_s, st->base_int);
+	st->moving = moving;
+	if (moving)
+		st->stationary = 0;
+	else if (st->stationary < WPAS_ADAPTIVE_MAX_SHIFT)
+		st->stationary++;
+	cur_int = wpas_adaptive_scan_int(wpa_s, st->base_int);
 
-scan:
-#ifdef CONFIG_P2P
 	/*
-	 * If the driver does not support multi-channel concurrency and a
-	 * virtual interface that shares the same radio with the wpa_s interface
-	 * is operating there may not be need to scan other channels apart from
-	 * the current operating channel on the other virtual interface. Filter
-	 * out other channels in case we are trying to find a connection for a
-	 * station interface when we are not configured to prefer station
-	 * connection and a concurrent operation is already in process.
+	 * Only periodic scans while not connected follow scan_interval, so
+	 * only those are counted. Scans saved are the base interval scans that
+	 * would have run since the previous periodic scan.
 	 */
-	if (wpa_s->scan_for_connection &&
-	    wpa_s->last_scan_req == NORMAL_SCAN_REQ &&
-	    !scan_params->freqs && !params.freqs &&
-	    wpas_is_p2p_prioritized(wpa_s) &&
-	    wpa_s->p2p_group_interface == NOT_P2P_GROUP_INTERFACE &&
-	    non_p2p_network_enabled(wpa_s)) {
-		unsigned int num = wpa_s->num_multichan_concurrent;
-
-		params.freqs = os_calloc(num + 1, sizeof(int));
-		if (params.freqs) {
-			num = get_shared_radio_freqs(wpa_s, params.freqs, num);
-			if (num > 0 && num == wpa_s->num_multichan_concurrent) {
-				wpa_dbg(wpa_s, MSG_DEBUG, "Scan only the current operating channels since all channels are already used");
-			} else {
-				os_free(params.freqs);
-				params.freqs = NULL;
-			}
+	if (st->base_int > 0 && wpa_s->last_scan_req == NORMAL_SCAN_REQ &&
+	    wpa_s->wpa_state <= WPA_SCANNING) {
+		os_get_reltime(&now);
+		if (st->last_periodic.sec && prev_int > st->base_int) {
+			os_reltime_sub(&now, &st->last_periodic, &age);
+			if (age.sec >= 2 * st->base_int)
+				st->scans_saved += age.sec / st->base_int - 1;
+		} else if (prev_int < st->base_int) {
+			st->extra_scans++;
 		}
+		st->last_periodic = now;
 	}
-#endif /* CONFIG_P2P */
 
-	ret = wpa_supplicant_trigger_scan(wpa_s, scan_params);
-
-	if (ret && wpa_s->last_scan_req == MANUAL_SCAN_REQ && params.freqs &&
-	    !wpa_s->manual_scan_freqs) {
-		/* Restore manual_scan_freqs for the next attempt */
-		wpa_s->manual_scan_freqs = params.freqs;
-		params.freqs = NULL;
+	if (cur_int != prev_int) {
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"Adaptive scan: %s (%u/%u BSSes changed) - scan interval %d -> %d sec",
+			moving ? "moving" : "stationary", changed, total,
+			prev_int, cur_int);
+		wpa_supplicant_update_scan_int(wpa_s, st->base_int);
 	}
+}
 
-	wpabuf_free(extra_ie);
-	os_free(params.freqs);
-	os_free(params.filter_ssids);
 
-	if (ret) {
-		wpa_msg(wpa_s, MSG_WARNING, "Failed to initiate AP scan");
-		if (wpa_s->scan_prev_wpa_state != wpa_s->wpa_state)
-			wpa_supplicant_set_state(wpa_s,
-						 wpa_s->scan_prev_wpa_state);
-		/* Restore scan_req since we will try to scan again */
-		wpa_s->scan_req = wpa_s->last_scan_req;
-		wpa_supplicant_req_scan(wpa_s, 1, 0);
-	} else {
-		wpa_s->scan_for_connection = 0;
-#ifdef CONFIG_INTERWORKING
-		wpa_s->interworking_fast_assoc_tried = 0;
-#endif /* CONFIG_INTERWORKING */
-		if (params.bssid)
-			os_memset(wpa_s->next_scan_bssid, 0, ETH_ALEN);
-	}
+/**
+ * wpas_adaptive_scan_status - Write adaptive scan interval state
+ * @wpa_s: Pointer to wpa_supplicant data
+ * @buf: Buffer for the text output
+ * @buflen: Length of the buffer
+ * Returns: Number of bytes written to the buffer or -1 on failure
+ */
+int wpas_adaptive_scan_status(struct wpa_supplicant *wpa_s, char *buf,
+			      size_t buflen)
+{
+	struct wpas_adaptive_scan *st = wpa_s->adaptive_scan;
+	int ret;
+
+	if (!st)
+		return 0;
+
+	ret = os_snprintf(buf, buflen,
+			  "adaptive_scan_moving=%d\n"
+			  "adaptive_scan_interval=%d\n"
+			  "adaptive_scan_base_interval=%d\n"
+			  "adaptive_scans_saved=%u\n"
+			  "adaptive_extra_scans=%u\n",
+			  st->moving, wpas_adaptive_scan_int(wpa_s, st->base_int),
+			  st->base_int, st->scans_saved, st->extra_scans);
+	if (os_snprintf_error(buflen, ret))
+		return -1;
+	return ret;
 }
 
 
@@ -1160,6 +3960,11 @@ void wpa_supplicant_update_scan_int(struct wpa_supplicant *wpa_s, int sec)
 	struct os_reltime remaining, new_int;
 	int cancelled;
 
+	if (wpa_s->adaptive_scan) {
+		wpa_s->adaptive_scan->base_int = sec;
+		sec = wpas_adaptive_scan_int(wpa_s, sec);
+	}
+
 	cancelled = eloop_cancel_timeout_one(wpa_supplicant_scan, wpa_s, NULL,
 					     &remaining);
 
@@ -1188,6 +3993,18 @@ void wpa_supplicant_update_scan_int(struct wpa_supplicant *wpa_s, int sec)
  * the specified time.
  */
 void wpa_supplicant_req_scan(struct wpa_supplicant *wpa_s, int sec, int usec)
+{
+	wpas_req_scan(wpa_s, sec, usec, 1);
+}
+
+
+/*
+ * Schedule a scan. @decision is set when the request follows from processing
+ * scan results, so that it ends the decide stage if it determines when the
+ * next scan starts.
+ */
+static void wpas_req_scan(struct wpa_supplicant *wpa_s, int sec, int usec,
+			  int decision)
 {
 	int res;
 
@@ -1212,11 +4029,15 @@ void wpa_supplicant_req_scan(struct wpa_supplicant *wpa_s, int sec, int usec)
 	} else if (res == 0) {
 		wpa_dbg(wpa_s, MSG_DEBUG, "Ignore new scan request for %d.%06d sec since an earlier request is scheduled to trigger sooner",
 			sec, usec);
+		return;
 	} else {
 		wpa_dbg(wpa_s, MSG_DEBUG, "Setting scan request: %d.%06d sec",
 			sec, usec);
 		eloop_register_timeout(sec, usec, wpa_supplicant_scan, wpa_s, NULL);
 	}
+
+	if (decision)
+		wpas_scan_stats_decided(wpa_s);
 }
 
 
@@ -1244,6 +4065,92 @@ int wpa_supplicant_delayed_sched_scan(struct wpa_supplicant *wpa_s,
 }
 
 
+/* Maximum number of scan plans passed to the driver */
+#define WPAS_MAX_SCHED_SCAN_PLANS 4
+
+/*
+ * Build a list of scan plans that follows the sched_scan back-off schedule:
+ * each plan doubles the interval of the previous one and runs for about as
+ * long as the timeout of the corresponding host restart used to allow. The
+ * last plan repeats until stopped. Returns the number of plans.
+ */
+static unsigned int
+wpas_sched_scan_build_plans(struct wpa_supplicant *wpa_s,
+			    struct sched_scan_plan *plans,
+			    unsigned int interval, unsigned int timeout)
+{
+	unsigned int i, num, iterations;
+
+	num = wpa_s->max_sched_scan_plans;
+	if (num > WPAS_MAX_SCHED_SCAN_PLANS)
+		num = WPAS_MAX_SCHED_SCAN_PLANS;
+
+	for (i = 0; i < num; i++) {
+		if (wpa_s->max_sched_scan_plan_interval &&
+		    interval >= wpa_s->max_sched_scan_plan_interval) {
+			interval = wpa_s->max_sched_scan_plan_interval;
+			break;
+		}
+		if (i + 1 == num)
+			break;
+
+		iterations = timeout / interval;
+		if (iterations < 1)
+			iterations = 1;
+		if (wpa_s->max_sched_scan_plan_iterations &&
+		    iterations > wpa_s->max_sched_scan_plan_iterations)
+			iterations = wpa_s->max_sched_scan_plan_iterations;
+
+		plans[i].interval = interval;
+		plans[i].iterations = iterations;
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"sched_scan plan %u: interval %u iterations %u",
+			i, interval, iterations);
+		interval *= 2;
+		timeout /= 2;
+		if (timeout == 0)
+			timeout = interval;
+	}
+
+	/* Last plan runs until the sched_scan is stopped */
+	plans[i].interval = interval;
+	plans[i].iterations = 0;
+	wpa_dbg(wpa_s, MSG_DEBUG, "sched_scan plan %u: interval %u (infinite)",
+		i, interval);
+
+	return i + 1;
+}
+
+
+/*
+ * While connected, ask the driver to report only BSSs that are better than the
+ * current AP by at least relative_rssi dB, after adjusting the RSSI of BSSs on
+ * the preferred band (relative_adjust_band) by relative_adjust_rssi dB. This
+ * avoids waking up the host for candidates that would not be roamed to.
+ */
+static void wpa_scan_set_relative_rssi_params(
+	struct wpa_supplicant *wpa_s, struct wpa_driver_scan_params *params)
+{
+	if (wpa_s->wpa_state != WPA_COMPLETED ||
+	    !(wpa_s->drv_flags & WPA_DRIVER_FLAGS_SCHED_SCAN_RELATIVE_RSSI) ||
+	    wpa_s->srp.relative_rssi_set == 0)
+		return;
+
+	params->relative_rssi_set = 1;
+	params->relative_rssi = wpa_s->srp.relative_rssi;
+
+	if (wpa_s->srp.relative_adjust_rssi == 0)
+		return;
+
+	params->relative_adjust_band = wpa_s->srp.relative_adjust_band;
+	params->relative_adjust_rssi = wpa_s->srp.relative_adjust_rssi;
+	wpa_dbg(wpa_s, MSG_DEBUG,
+		"Sched scan relative RSSI %d dB, band %d adjust %d dB",
+		params->relative_rssi, params->relative_adjust_band,
+		params->relative_adjust_rssi);
+}
+
+
 /**
  * wpa_supplicant_req_sched_scan - Start a periodic scheduled scan
  * @wpa_s: Pointer to wpa_supplicant data
@@ -1256,6 +4163,7 @@ int wpa_supplicant_req_sched_scan(struct wpa_supplicant *wpa_s)
 {
 	struct wpa_driver_scan_params params;
 	struct wpa_driver_scan_params *scan_params;
+	struct sched_scan_plan plans[WPAS_MAX_SCHED_SCAN_PLANS];
 	enum wpa_states prev_state;
 	struct wpa_ssid *ssid = NULL;
 	struct wpabuf *extra_ie = NULL;
@@ -1362,6 +4270,9 @@ int wpa_supplicant_req_sched_scan(struct wpa_supplicant *wpa_s)
 				wpa_s->conf->sched_scan_interval;
 		if (wpa_s->sched_scan_interval == 0)
 			wpa_s->sched_scan_interval = 10;
+		wpa_s->sched_scan_interval =
+			wpas_adaptive_scan_int(wpa_s,
+					       wpa_s->sched_scan_interval);
 		wpa_s->sched_scan_timeout = max_sched_scan_ssids * 2;
 		wpa_s->first_sched_scan = 1;
 		ssid = wpa_s->conf->ssid;
@@ -1445,8 +4356,30 @@ int wpa_supplicant_req_sched_scan(struct wpa_supplicant *wpa_s)
 
 	scan_params = &params;
 
+	/*
+	 * With scan plans, the driver follows the back-off on its own, also
+	 * while the host is suspended, so no host timeout is needed to stretch
+	 * the interval. When the SSIDs do not fit into one request, the next
+	 * group is scheduled only when the host is woken up by sched_scan
+	 * results anyway (wpas_sched_scan_rotate()), not by a timeout.
+	 */
+	if (wpa_s->max_sched_scan_plans > 1) {
+		params.sched_scan_plans = plans;
+		params.sched_scan_plans_num =
+			wpas_sched_scan_build_plans(
+				wpa_s, plans, wpa_s->sched_scan_interval,
+				wpa_s->sched_scan_timeout);
+	}
+
 scan:
-	if (ssid || !wpa_s->first_sched_scan) {
+	if (params.sched_scan_plans_num) {
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"Starting sched scan: interval %d (%u scan plans%s)",
+			wpa_s->sched_scan_interval,
+			(unsigned int) params.sched_scan_plans_num,
+			ssid || !wpa_s->first_sched_scan ?
+			", rotate on results" : "");
+	} else if (ssid || !wpa_s->first_sched_scan) {
 		wpa_dbg(wpa_s, MSG_DEBUG,
 			"Starting sched scan: interval %d timeout %d",
 			wpa_s->sched_scan_interval, wpa_s->sched_scan_timeout);
@@ -1457,6 +4390,7 @@ scan:
 	}
 
 	wpa_setband_scan_freqs(wpa_s, scan_params);
+	wpa_scan_set_relative_rssi_params(wpa_s, scan_params);
 
 	if (!wpa_s->current_ssid &&
 	    wpa_s->mac_addr_rand_enable & MAC_ADDR_RAND_SCHED_SCAN)
@@ -1473,8 +4407,14 @@ scan:
 		return ret;
 	}
 
-	/* If we have more SSIDs to scan, add a timeout so we scan them too */
-	if (ssid || !wpa_s->first_sched_scan) {
+	wpa_s->sched_scan_rotate = 0;
+	if (params.sched_scan_plans_num) {
+		/* Rotate to the next SSIDs on the next sched_scan results */
+		if (ssid || !wpa_s->first_sched_scan)
+			wpa_s->sched_scan_rotate = 1;
+		wpa_s->first_sched_scan = 0;
+	} else if (ssid || !wpa_s->first_sched_scan) {
+		/* More SSIDs to scan, add a timeout so we scan them too */
 		wpa_s->sched_scan_timed_out = 0;
 		eloop_register_timeout(wpa_s->sched_scan_timeout, 0,
 				       wpa_supplicant_sched_scan_timeout,
@@ -1496,6 +4436,25 @@ scan:
 }
 
 
+/*
+ * Called for new scan results. Results without an own scan work while a
+ * sched_scan is running are sched_scan results, i.e., the host has been woken
+ * up. If the sched_scan rotates through SSID groups with scan plans, restart
+ * it with the next group now, like the sched_scan timeout would without plans.
+ */
+static void wpas_sched_scan_rotate(struct wpa_supplicant *wpa_s)
+{
+	if (!wpa_s->sched_scanning || !wpa_s->sched_scan_rotate ||
+	    wpa_s->scan_work)
+		return;
+
+	wpa_dbg(wpa_s, MSG_DEBUG, "Sched scan results - rotate SSIDs");
+	wpa_s->sched_scan_rotate = 0;
+	wpa_s->sched_scan_timed_out = 1;
+	wpa_supplicant_cancel_sched_scan(wpa_s);
+}
+
+
 /**
  * wpa_supplicant_cancel_scan - Cancel a scheduled scan request
  * @wpa_s: Pointer to wpa_supplicant data
@@ -1506,7 +4465,10 @@ scan:
 void wpa_supplicant_cancel_scan(struct wpa_supplicant *wpa_s)
 {
 	wpa_dbg(wpa_s, MSG_DEBUG, "Cancelling scan request");
+	wpas_scan_stats_decided(wpa_s);
 	eloop_cancel_timeout(wpa_supplicant_scan, wpa_s, NULL);
+	wpas_scan_chunks_free(wpa_s);
+	wpa_s->batch_probe_active = 0;
 }
 
 
@@ -1727,8 +4689,6 @@ struct wpabuf * wpa_scan_get_vendor_ie_multi(const struct wpa_scan_res *res,
 }
 
 
-#define IS_5GHZ(n) (n > 4000)
-
 /* Compare function for sorting scan results. Return >0 if @b is considered
  * better. */
 static int wpa_scan_result_compar(const void *a, const void *b)
@@ -2062,55 +5022,421 @@ void scan_est_throughput(struct wpa_supplicant *wpa_s,
 		rate = 54 * 2;
 	est = rate * 500;
 
-	if (capab == CAPAB_HT || capab == CAPAB_HT40 || capab == CAPAB_VHT) {
-		ie = wpa_scan_get_ie(res, WLAN_EID_HT_CAP);
-		if (ie) {
-			tmp = max_ht20_rate(snr);
-			if (tmp > est)
-				est = tmp;
-		}
+	if (capab == CAPAB_HT || capab == CAPAB_HT40 || capab == CAPAB_VHT) {
+		ie = wpa_scan_get_ie(res, WLAN_EID_HT_CAP);
+		if (ie) {
+			tmp = max_ht20_rate(snr);
+			if (tmp > est)
+				est = tmp;
+		}
+	}
+
+	if (capab == CAPAB_HT40 || capab == CAPAB_VHT) {
+		ie = wpa_scan_get_ie(res, WLAN_EID_HT_OPERATION);
+		if (ie && ie[1] >= 2 &&
+		    (ie[3] & HT_INFO_HT_PARAM_SECONDARY_CHNL_OFF_MASK)) {
+			tmp = max_ht40_rate(snr);
+			if (tmp > est)
+				est = tmp;
+		}
+	}
+
+	if (capab == CAPAB_VHT) {
+		/* Use +1 to assume VHT is always faster than HT */
+		ie = wpa_scan_get_ie(res, WLAN_EID_VHT_CAP);
+		if (ie) {
+			tmp = max_ht20_rate(snr) + 1;
+			if (tmp > est)
+				est = tmp;
+
+			ie = wpa_scan_get_ie(res, WLAN_EID_HT_OPERATION);
+			if (ie && ie[1] >= 2 &&
+			    (ie[3] &
+			     HT_INFO_HT_PARAM_SECONDARY_CHNL_OFF_MASK)) {
+				tmp = max_ht40_rate(snr) + 1;
+				if (tmp > est)
+					est = tmp;
+			}
+
+			ie = wpa_scan_get_ie(res, WLAN_EID_VHT_OPERATION);
+			if (ie && ie[1] >= 1 &&
+			    (ie[2] & VHT_OPMODE_CHANNEL_WIDTH_MASK)) {
+				tmp = max_vht80_rate(snr) + 1;
+				if (tmp > est)
+					est = tmp;
+			}
+		}
+	}
+
+	/* TODO: channel utilization and AP load (e.g., from AP Beacon) */
+
+	res->est_throughput = est;
+}
+
+
+/*
+ * Post-process scan results from the driver: drop filtered BSSs, compute SNR
+ * and estimated throughput and sort the results into preference order.
+ */
+static void wpas_scan_res_process(struct wpa_supplicant *wpa_s,
+				  struct wpa_scan_results *scan_res)
+{
+	size_t i;
+	int (*compar)(const void *, const void *) = wpa_scan_result_compar;
+
+	filter_scan_res(wpa_s, scan_res);
+
+	for (i = 0; i < scan_res->num; i++) {
+		struct wpa_scan_res *scan_res_item = scan_res->res[i];
+
+		scan_snr(scan_res_item);
+		scan_est_throughput(wpa_s, scan_res_item);
+	}
+
+#ifdef CONFIG_WPS
+	if (wpas_wps_searching(wpa_s)) {
+		wpa_dbg(wpa_s, MSG_DEBUG, "WPS: Order scan results with WPS "
+			"provisioning rules");
+		compar = wpa_scan_result_wps_compar;
+	}
+#endif /* CONFIG_WPS */
+
+	qsort(scan_res->res, scan_res->num, sizeof(struct wpa_scan_res *),
+	      compar);
+}
+
+
+/*
+ * Scan result delta
+ *
+ * The BSS table after each new scan is compared with the table after the
+ * previous one to find the BSSs that were added, removed or changed. A change
+ * is reported with a mask of what changed: the signal level moved to another
+ * WPAS_SCAN_DELTA_RSSI_BUCKET dB bucket, the IEs or the frequency. Elements
+ * that change with every Beacon frame (TIM, BSS Load) are left out of the IE
+ * comparison. Tracking starts with the first wpas_scan_delta() call, so
+ * nothing is computed until there is a reader. A reader polls the delta of
+ * the latest scan and uses the sequence number to notice a scan it missed; it
+ * then re-reads the full BSS table instead.
+ */
+#define WPAS_SCAN_DELTA_RSSI_BUCKET 5
+
+#define WPAS_SCAN_DELTA_RSSI BIT(0)
+#define WPAS_SCAN_DELTA_IES BIT(1)
+#define WPAS_SCAN_DELTA_FREQ BIT(2)
+
+enum wpas_scan_delta_type {
+	WPAS_SCAN_DELTA_ADDED,
+	WPAS_SCAN_DELTA_REMOVED,
+	WPAS_SCAN_DELTA_CHANGED,
+};
+
+/* State of a BSS table entry, sorted by id */
+struct wpas_scan_delta_bss {
+	unsigned int id;
+	u8 bssid[ETH_ALEN];
+	int freq;
+	int rssi_bucket;
+	u32 ie_hash;
+	struct os_reltime last_update;
+};
+
+struct wpas_scan_delta_entry {
+	unsigned int id;
+	u8 bssid[ETH_ALEN];
+	enum wpas_scan_delta_type type;
+	unsigned int mask;
+};
+
+struct wpas_scan_delta {
+	/* BSS table state after the latest and the previous new scan */
+	struct wpas_scan_delta_bss *bss;
+	size_t num_bss;
+	struct wpas_scan_delta_bss *prev;
+	size_t num_prev;
+	/* Changes from prev to bss, room for 2 * size entries */
+	struct wpas_scan_delta_entry *entry;
+	size_t num_entries;
+	/* Allocated length of bss and prev */
+	size_t size;
+	unsigned int num_added;
+	unsigned int num_removed;
+	unsigned int num_changed;
+	unsigned int seq;
+};
+
+
+static int wpas_scan_delta_rssi_bucket(int level)
+{
+	if (level >= 0)
+		return level / WPAS_SCAN_DELTA_RSSI_BUCKET;
+	return -((-level + WPAS_SCAN_DELTA_RSSI_BUCKET - 1) /
+		 WPAS_SCAN_DELTA_RSSI_BUCKET);
+}
+
+
+static u32 wpas_scan_delta_ie_hash(const struct wpa_bss *bss)
+{
+	const u8 *pos = (const u8 *) (bss + 1);
+	const u8 *end = pos + bss->ie_len;
+	u32 hash = 2166136261U; /* FNV-1a */
+
+	while (end - pos >= 2 && 2 + pos[1] <= end - pos) {
+		size_t i, len = 2 + pos[1];
+
+		if (pos[0] != WLAN_EID_TIM && pos[0] != WLAN_EID_BSS_LOAD) {
+			for (i = 0; i < len; i++) {
+				hash ^= pos[i];
+				hash *= 16777619U;
+			}
+		}
+		pos += len;
+	}
+
+	return hash;
+}
+
+
+static void wpas_scan_delta_add(struct wpas_scan_delta_entry *entry,
+				const struct wpas_scan_delta_bss *bss,
+				enum wpas_scan_delta_type type,
+				unsigned int mask)
+{
+	entry->id = bss->id;
+	os_memcpy(entry->bssid, bss->bssid, ETH_ALEN);
+	entry->type = type;
+	entry->mask = mask;
+}
+
+
+/*
+ * Compare two BSS table states, both sorted by BSS id, which is unique for
+ * the lifetime of an entry, so a single merge pass finds all changes. The
+ * changes are written to entry, which must have room for num_old + num
+ * entries. Returns the number of changes.
+ */
+static size_t wpas_scan_delta_diff(const struct wpas_scan_delta_bss *old,
+				   size_t num_old,
+				   const struct wpas_scan_delta_bss *cur,
+				   size_t num,
+				   struct wpas_scan_delta_entry *entry)
+{
+	const struct wpas_scan_delta_bss *o, *c;
+	size_t i = 0, j = 0, changes = 0;
+
+	while (i < num_old || j < num) {
+		o = i < num_old ? &old[i] : NULL;
+		c = j < num ? &cur[j] : NULL;
+
+		if (!c || (o && o->id < c->id)) {
+			wpas_scan_delta_add(&entry[changes++], o,
+					    WPAS_SCAN_DELTA_REMOVED, 0);
+			i++;
+		} else if (!o || c->id < o->id) {
+			wpas_scan_delta_add(&entry[changes++], c,
+					    WPAS_SCAN_DELTA_ADDED, 0);
+			j++;
+		} else {
+			unsigned int mask = 0;
+
+			if (c->rssi_bucket != o->rssi_bucket)
+				mask |= WPAS_SCAN_DELTA_RSSI;
+			if (c->ie_hash != o->ie_hash)
+				mask |= WPAS_SCAN_DELTA_IES;
+			if (c->freq != o->freq)
+				mask |= WPAS_SCAN_DELTA_FREQ;
+			if (mask)
+				wpas_scan_delta_add(&entry[changes++], c,
+						    WPAS_SCAN_DELTA_CHANGED,
+						    mask);
+			i++;
+			j++;
+		}
+	}
+
+	return changes;
+}
+
+
+/* Make room for a BSS table state of num entries; never shrinks */
+static int wpas_scan_delta_resize(struct wpas_scan_delta *delta, size_t num)
+{
+	struct wpas_scan_delta_bss *bss;
+	struct wpas_scan_delta_entry *entry;
+	size_t size;
+
+	if (num <= delta->size)
+		return 0;
+	size = num < 16 ? 16 : 2 * num;
+
+	bss = os_realloc_array(delta->bss, size, sizeof(*bss));
+	if (!bss)
+		return -1;
+	delta->bss = bss;
+	bss = os_realloc_array(delta->prev, size, sizeof(*bss));
+	if (!bss)
+		return -1;
+	delta->prev = bss;
+	entry = os_realloc_array(delta->entry, 2 * size, sizeof(*entry));
+	if (!entry)
+		return -1;
+	delta->entry = entry;
+	delta->size = size;
+
+	return 0;
+}
+
+
+/*
+ * Record the current BSS table state and keep the previous one. The bss_id
+ * list is in id order, so the state needs no sorting. The IEs of an entry are
+ * only hashed again if it was updated since the previous state. The buffers
+ * are reused; nothing is allocated unless the table grew.
+ */
+static int wpas_scan_delta_record(struct wpa_supplicant *wpa_s,
+				  struct wpas_scan_delta *delta)
+{
+	struct wpas_scan_delta_bss *tmp, *c;
+	const struct wpas_scan_delta_bss *o;
+	struct wpa_bss *bss;
+	size_t num = 0, i = 0;
+
+	if (wpas_scan_delta_resize(delta, wpa_s->num_bss) < 0)
+		return -1;
+
+	tmp = delta->prev;
+	delta->prev = delta->bss;
+	delta->num_prev = delta->num_bss;
+	delta->bss = tmp;
+
+	dl_list_for_each(bss, &wpa_s->bss_id, struct wpa_bss, list_id) {
+		if (num == delta->size)
+			break;
+		while (i < delta->num_prev && delta->prev[i].id < bss->id)
+			i++;
+		o = i < delta->num_prev && delta->prev[i].id == bss->id ?
+			&delta->prev[i] : NULL;
+
+		c = &delta->bss[num++];
+		c->id = bss->id;
+		os_memcpy(c->bssid, bss->bssid, ETH_ALEN);
+		c->freq = bss->freq;
+		c->rssi_bucket = wpas_scan_delta_rssi_bucket(bss->level);
+		c->last_update = bss->last_update;
+		if (o && o->last_update.sec == bss->last_update.sec &&
+		    o->last_update.usec == bss->last_update.usec)
+			c->ie_hash = o->ie_hash;
+		else
+			c->ie_hash = wpas_scan_delta_ie_hash(bss);
 	}
+	delta->num_bss = num;
 
-	if (capab == CAPAB_HT40 || capab == CAPAB_VHT) {
-		ie = wpa_scan_get_ie(res, WLAN_EID_HT_OPERATION);
-		if (ie && ie[1] >= 2 &&
-		    (ie[3] & HT_INFO_HT_PARAM_SECONDARY_CHNL_OFF_MASK)) {
-			tmp = max_ht40_rate(snr);
-			if (tmp > est)
-				est = tmp;
-		}
+	return 0;
+}
+
+
+/* Compute the delta of a new scan if there is a reader for it */
+static void wpas_scan_delta_update(struct wpa_supplicant *wpa_s)
+{
+	struct wpas_scan_delta *delta = wpa_s->scan_delta;
+	size_t i;
+
+	if (!delta || wpas_scan_delta_record(wpa_s, delta) < 0)
+		return;
+
+	delta->num_entries = wpas_scan_delta_diff(delta->prev, delta->num_prev,
+						  delta->bss, delta->num_bss,
+						  delta->entry);
+	delta->num_added = delta->num_removed = delta->num_changed = 0;
+	for (i = 0; i < delta->num_entries; i++) {
+		if (delta->entry[i].type == WPAS_SCAN_DELTA_ADDED)
+			delta->num_added++;
+		else if (delta->entry[i].type == WPAS_SCAN_DELTA_REMOVED)
+			delta->num_removed++;
+		else
+			delta->num_changed++;
 	}
+	delta->seq++;
 
-	if (capab == CAPAB_VHT) {
-		/* Use +1 to assume VHT is always faster than HT */
-		ie = wpa_scan_get_ie(res, WLAN_EID_VHT_CAP);
-		if (ie) {
-			tmp = max_ht20_rate(snr) + 1;
-			if (tmp > est)
-				est = tmp;
+	wpa_dbg(wpa_s, MSG_DEBUG,
+		"Scan delta %u: %u added, %u removed, %u changed",
+		delta->seq, delta->num_added, delta->num_removed,
+		delta->num_changed);
+}
 
-			ie = wpa_scan_get_ie(res, WLAN_EID_HT_OPERATION);
-			if (ie && ie[1] >= 2 &&
-			    (ie[3] &
-			     HT_INFO_HT_PARAM_SECONDARY_CHNL_OFF_MASK)) {
-				tmp = max_ht40_rate(snr) + 1;
-				if (tmp > est)
-					est = tmp;
-			}
 
-			ie = wpa_scan_get_ie(res, WLAN_EID_VHT_OPERATION);
-			if (ie && ie[1] >= 1 &&
-			    (ie[2] & VHT_OPMODE_CHANNEL_WIDTH_MASK)) {
-				tmp = max_vht80_rate(snr) + 1;
-				if (tmp > est)
-					est = tmp;
-			}
+static void wpas_scan_delta_deinit(struct wpa_supplicant *wpa_s)
+{
+	if (!wpa_s->scan_delta)
+		return;
+	os_free(wpa_s->scan_delta->bss);
+	os_free(wpa_s->scan_delta->prev);
+	os_free(wpa_s->scan_delta->entry);
+	os_free(wpa_s->scan_delta);
+	wpa_s->scan_delta = NULL;
+}
+
+
+/**
+ * wpas_scan_delta - Read the delta of the latest scan in text format
+ * @wpa_s: Pointer to wpa_supplicant data
+ * @buf: Buffer for the delta
+ * @buflen: Length of the buffer
+ * Returns: Number of octets written to the buffer
+ *
+ * The first line holds the sequence number of the latest new scan and the
+ * number of BSSs it added, removed and changed. It is followed by one line per
+ * added, removed or changed BSS with the BSS id and BSSID and, for changed
+ * entries, the names of the changed attributes (rssi, ies, freq). The first
+ * call starts the tracking and only reports seq=0; the following new scans are
+ * compared with the BSS table at that time.
+ */
+int wpas_scan_delta(struct wpa_supplicant *wpa_s, char *buf, size_t buflen)
+{
+	struct wpas_scan_delta *delta = wpa_s->scan_delta;
+	static const char * const type_str[] = { "added", "removed",
+						 "changed" };
+	/* Indexed by the change mask */
+	static const char * const change_str[] = {
+		"", " changes=rssi", " changes=ies", " changes=rssi,ies",
+		" changes=freq", " changes=rssi,freq", " changes=ies,freq",
+		" changes=rssi,ies,freq"
+	};
+	char *pos = buf, *end = buf + buflen;
+	size_t i;
+	int ret;
+
+	if (!delta) {
+		delta = os_zalloc(sizeof(*delta));
+		if (!delta)
+			return 0;
+		wpa_s->scan_delta = delta;
+		if (wpas_scan_delta_record(wpa_s, delta) < 0) {
+			wpas_scan_delta_deinit(wpa_s);
+			return 0;
 		}
 	}
 
-	/* TODO: channel utilization and AP load (e.g., from AP Beacon) */
+	ret = os_snprintf(pos, end - pos,
+			  "seq=%u added=%u removed=%u changed=%u\n",
+			  delta->seq, delta->num_added, delta->num_removed,
+			  delta->num_changed);
+	if (os_snprintf_error(end - pos, ret))
+		return pos - buf;
+	pos += ret;
+
+	for (i = 0; i < delta->num_entries; i++) {
+		struct wpas_scan_delta_entry *e = &delta->entry[i];
+
+		ret = os_snprintf(pos, end - pos, "%s id=%u bssid=" MACSTR
+				  "%s\n", type_str[e->type], e->id,
+				  MAC2STR(e->bssid), change_str[e->mask]);
+		if (os_snprintf_error(end - pos, ret))
+			return pos - buf;
+		pos += ret;
+	}
 
-	res->est_throughput = est;
+	return pos - buf;
 }
 
 
@@ -2130,8 +5456,18 @@ wpa_supplicant_get_scan_results(struct wpa_supplicant *wpa_s,
 				struct scan_info *info, int new_scan)
 {
 	struct wpa_scan_results *scan_res;
+	struct wpas_scan_stats *stats;
+	struct wpas_network_set networks;
+	struct os_reltime fetch;
 	size_t i;
-	int (*compar)(const void *, const void *) = wpa_scan_result_compar;
+
+	stats = new_scan ? wpas_scan_stats_get(wpa_s) : NULL;
+	if (stats && stats->work && stats->work == wpa_s->scan_work) {
+		wpas_scan_stats_end(stats, WPAS_SCAN_STAGE_SCAN,
+				    &stats->trigger);
+		stats->work = NULL;
+	}
+	os_get_reltime(&fetch);
 
 	scan_res = wpa_drv_get_scan_results2(wpa_s);
 	if (scan_res == NULL) {
@@ -2145,27 +5481,14 @@ wpa_supplicant_get_scan_results(struct wpa_supplicant *wpa_s,
 		 */
 		os_get_reltime(&scan_res->fetch_time);
 	}
-	filter_scan_res(wpa_s, scan_res);
-
-	for (i = 0; i < scan_res->num; i++) {
-		struct wpa_scan_res *scan_res_item = scan_res->res[i];
-
-		scan_snr(scan_res_item);
-		scan_est_throughput(wpa_s, scan_res_item);
-	}
-
-#ifdef CONFIG_WPS
-	if (wpas_wps_searching(wpa_s)) {
-		wpa_dbg(wpa_s, MSG_DEBUG, "WPS: Order scan results with WPS "
-			"provisioning rules");
-		compar = wpa_scan_result_wps_compar;
-	}
-#endif /* CONFIG_WPS */
-
-	qsort(scan_res->res, scan_res->num, sizeof(struct wpa_scan_res *),
-	      compar);
+	wpas_scan_res_process(wpa_s, scan_res);
 	dump_scan_res(scan_res);
 
+	/* Left empty if it cannot be built: no result matches a network */
+	os_memset(&networks, 0, sizeof(networks));
+	if (new_scan && wpas_network_set_init(wpa_s, &networks) == 0)
+		wpas_chan_hist_update(wpa_s, &networks, scan_res);
+
 	scan_res->aborted = (info && info->aborted);
 
 	wpa_bss_update_start(wpa_s);
@@ -2173,6 +5496,24 @@ wpa_supplicant_get_scan_results(struct wpa_supplicant *wpa_s,
 		wpa_bss_update_scan_res(wpa_s, scan_res->res[i],
 					&scan_res->fetch_time);
 	wpa_bss_update_end(wpa_s, info, new_scan);
+	if (stats) {
+		wpas_scan_stats_end(stats, WPAS_SCAN_STAGE_PROCESS, &fetch);
+		os_get_reltime(&stats->done);
+	}
+
+	if (new_scan) {
+		wpas_scan_delta_update(wpa_s);
+		wpas_chan_stats_results(wpa_s, &networks, scan_res);
+		wpas_adaptive_scan_update(wpa_s, scan_res, info);
+		wpas_scan_chunk_done(wpa_s, &networks, scan_res);
+		wpas_sched_scan_rotate(wpa_s);
+		if (wpa_s->batch_probe_active)
+			wpas_scan_batch_probe_next(wpa_s);
+	}
+
+	wpas_network_set_deinit(&networks);
+	if (new_scan)
+		wpas_alloc_trace_cycle_end(wpa_s);
 
 	return scan_res;
 }
@@ -2202,6 +5543,152 @@ int wpa_supplicant_update_scan_results(struct wpa_supplicant *wpa_s)
 }
 
 
+/*
+ * Per-channel scan statistics
+ *
+ * For each channel, count how often it has been scanned, how many BSSs were
+ * found on it and how many of them matched an enabled network, and estimate
+ * the time spent on it by dividing the duration of each scan evenly over its
+ * channels. Channels with a low yield per dwell time are candidates for
+ * pruning from scans. The table is indexed like struct wpas_chan_bitmap, so
+ * frequencies outside its ranges are not tracked.
+ */
+struct wpas_chan_stats_entry {
+	unsigned int scans;
+	unsigned int bss;
+	unsigned int match;
+	unsigned int dwell_ms;
+};
+
+struct wpas_chan_stats {
+	struct wpas_chan_stats_entry chan[WPAS_CHAN_BITMAP_BITS];
+	/* Channels of the scan in progress */
+	struct wpas_chan_bitmap scanned;
+	int pending;
+};
+
+
+static struct wpas_chan_stats *
+wpas_chan_stats_get(struct wpa_supplicant *wpa_s)
+{
+	if (!wpa_s->chan_stats)
+		wpa_s->chan_stats = os_zalloc(sizeof(*wpa_s->chan_stats));
+	return wpa_s->chan_stats;
+}
+
+
+/* Note the channels of a scan that the driver has accepted */
+static void wpas_chan_stats_triggered(
+	struct wpa_supplicant *wpa_s,
+	const struct wpa_driver_scan_params *params)
+{
+	struct wpas_chan_stats *cs;
+
+	cs = wpas_chan_stats_get(wpa_s);
+	if (!cs)
+		return;
+
+	wpas_chan_bitmap_init(&cs->scanned);
+	if (params->freqs)
+		wpas_chan_bitmap_add_list(&cs->scanned, params->freqs);
+	else
+		wpas_scan_all_freqs(wpa_s, &cs->scanned);
+	cs->pending = 1;
+}
+
+
+/* Account the results of an own scan to the scanned channels */
+static void wpas_chan_stats_results(struct wpa_supplicant *wpa_s,
+				    const struct wpas_network_set *networks,
+				    struct wpa_scan_results *scan_res)
+{
+	struct wpas_chan_stats *cs = wpa_s->chan_stats;
+	struct wpas_chan_stats_entry *e;
+	struct os_reltime diff;
+	unsigned int num, dwell, i;
+	int bit;
+
+	if (!cs || !cs->pending)
+		return;
+	cs->pending = 0;
+
+	num = wpas_chan_bitmap_count(&cs->scanned) - cs->scanned.num_other;
+	if (!num)
+		return;
+	os_reltime_sub(&scan_res->fetch_time, &wpa_s->scan_trigger_time,
+		       &diff);
+	dwell = diff.sec < 0 ? 0 :
+		(diff.sec * 1000 + diff.usec / 1000) / num;
+
+	for (bit = 0; bit < WPAS_CHAN_BITMAP_BITS; bit++) {
+		if (!(cs->scanned.bits[bit / 32] & BIT(bit % 32)))
+			continue;
+		cs->chan[bit].scans++;
+		cs->chan[bit].dwell_ms += dwell;
+	}
+
+	for (i = 0; i < scan_res->num; i++) {
+		bit = wpas_chan_bitmap_bit(scan_res->res[i]->freq);
+		if (bit < 0 ||
+		    !wpas_chan_bitmap_test(&cs->scanned,
+					   scan_res->res[i]->freq))
+			continue;
+		e = &cs->chan[bit];
+		e->bss++;
+		if (wpas_scan_res_enabled_network(networks, scan_res->res[i]))
+			e->match++;
+	}
+}
+
+
+/**
+ * wpas_scan_chan_stats - Write per-channel scan statistics
+ * @wpa_s: Pointer to wpa_supplicant data
+ * @buf: Buffer for the text output
+ * @buflen: Length of the buffer
+ * Returns: Number of bytes written to the buffer or -1 on failure
+ *
+ * This function is used by the control interface to export one line per
+ * scanned channel: number of scans, BSSs found, BSSs matching an enabled
+ * network and the estimated total and average dwell time.
+ */
+int wpas_scan_chan_stats(struct wpa_supplicant *wpa_s, char *buf,
+			 size_t buflen)
+{
+	struct wpas_chan_stats *cs = wpa_s->chan_stats;
+	struct wpas_chan_stats_entry *e;
+	char *pos = buf, *end = buf + buflen;
+	int bit, ret;
+
+	for (bit = 0; cs && bit < WPAS_CHAN_BITMAP_BITS; bit++) {
+		e = &cs->chan[bit];
+		if (!e->scans)
+			continue;
+		ret = os_snprintf(pos, end - pos,
+				  "freq=%d scans=%u bss=%u match=%u dwell_ms=%u avg_dwell_ms=%u\n",
+				  wpas_chan_bitmap_freq(bit), e->scans, e->bss,
+				  e->match, e->dwell_ms, e->dwell_ms / e->scans);
+		if (os_snprintf_error(end - pos, ret))
+			return pos - buf;
+		pos += ret;
+	}
+
+	return pos - buf;
+}
+
+
+/**
+ * wpas_scan_chan_stats_reset - Clear per-channel scan statistics
+ * @wpa_s: Pointer to wpa_supplicant data
+ */
+void wpas_scan_chan_stats_reset(struct wpa_supplicant *wpa_s)
+{
+	if (wpa_s->chan_stats)
+		os_memset(wpa_s->chan_stats->chan, 0,
+			  sizeof(wpa_s->chan_stats->chan));
+}
+
+
 /**
  * scan_only_handler - Reports scan results
  */
@@ -2209,6 +5696,7 @@ void scan_only_handler(struct wpa_supplicant *wpa_s,
 		       struct wpa_scan_results *scan_res)
 {
 	wpa_dbg(wpa_s, MSG_DEBUG, "Scan-only results received");
+	wpas_scan_stats_decided(wpa_s);
 	if (wpa_s->last_scan_req == MANUAL_SCAN_REQ &&
 	    wpa_s->manual_scan_use_id && wpa_s->own_scan_running) {
 		wpa_msg_ctrl(wpa_s, MSG_INFO, WPA_EVENT_SCAN_RESULTS "id=%u",
@@ -2233,6 +5721,114 @@ int wpas_scan_scheduled(struct wpa_supplicant *wpa_s)
 }
 
 
+/**
+ * wpas_scan_retry_status - Write scan trigger retry counters
+ * @wpa_s: Pointer to wpa_supplicant data
+ * @buf: Buffer for the text output
+ * @buflen: Length of the buffer
+ * Returns: Number of bytes written to the buffer or -1 on failure
+ *
+ * This function is used by the control interface STATUS command to report
+ * the state of the scan trigger retry back-off as name=value lines.
+ */
+int wpas_scan_retry_status(struct wpa_supplicant *wpa_s, char *buf,
+			   size_t buflen)
+{
+	int ret;
+
+	ret = os_snprintf(buf, buflen,
+			  "scan_trigger_failures=%u\n"
+			  "scan_retries=%u\n"
+			  "scan_retry_last_delay_ms=%u\n"
+			  "scan_retry_pending=%d\n",
+			  wpa_s->scan_trigger_failures,
+			  wpa_s->scan_retries,
+			  wpa_s->scan_retry_last_delay,
+			  wpa_s->scan_trigger_failures &&
+			  wpas_scan_scheduled(wpa_s));
+	if (os_snprintf_error(buflen, ret))
+		return -1;
+	return ret;
+}
+
+
+/**
+ * wpas_scan_stats - Write scan latency statistics
+ * @wpa_s: Pointer to wpa_supplicant data
+ * @buf: Buffer for the text output
+ * @buflen: Length of the buffer
+ * Returns: Number of bytes written to the buffer or -1 on failure
+ *
+ * This function is used by the control interface SCAN_STATS command. Each
+ * line reports one stage: count, average and maximum duration and the
+ * histogram bucket counts.
+ */
+int wpas_scan_stats(struct wpa_supplicant *wpa_s, char *buf, size_t buflen)
+{
+	struct wpas_scan_stats *stats;
+	struct wpas_scan_stage_stats *s;
+	struct os_reltime now;
+	char *pos = buf, *end = buf + buflen;
+	unsigned int i, j;
+	int ret;
+
+	stats = wpas_scan_stats_get(wpa_s);
+	if (!stats)
+		return -1;
+
+	os_get_reltime(&now);
+	ret = os_snprintf(pos, end - pos, "since_sec=%ld\n",
+			  (long) (now.sec - stats->since.sec));
+	if (os_snprintf_error(end - pos, ret))
+		return pos - buf;
+	pos += ret;
+
+	for (i = 0; i < WPAS_SCAN_STAGES; i++) {
+		s = &stats->stage[i];
+		ret = os_snprintf(pos, end - pos,
+				  "%s count=%u avg_ms=%u max_ms=%u hist=",
+				  wpas_scan_stage_name[i], s->count,
+				  s->count ? (unsigned int)
+				  (s->total_ms / s->count) : 0,
+				  s->max_ms);
+		if (os_snprintf_error(end - pos, ret))
+			return pos - buf;
+		pos += ret;
+		for (j = 0; j < WPAS_SCAN_STATS_BUCKETS; j++) {
+			ret = os_snprintf(pos, end - pos, "%s%u",
+					  j ? "," : "", s->hist[j]);
+			if (os_snprintf_error(end - pos, ret))
+				return pos - buf;
+			pos += ret;
+		}
+		ret = os_snprintf(pos, end - pos, "\n");
+		if (os_snprintf_error(end - pos, ret))
+			return pos - buf;
+		pos += ret;
+	}
+
+	return pos - buf;
+}
+
+
+/**
+ * wpas_scan_stats_reset - Clear scan latency statistics
+ * @wpa_s: Pointer to wpa_supplicant data
+ *
+ * This function is used by the control interface SCAN_STATS RESET command.
+ * Stages in progress keep their start time.
+ */
+void wpas_scan_stats_reset(struct wpa_supplicant *wpa_s)
+{
+	struct wpas_scan_stats *stats = wpa_s->scan_stats;
+
+	if (!stats)
+		return;
+	os_memset(stats->stage, 0, sizeof(stats->stage));
+	os_get_reltime(&stats->since);
+}
+
+
 struct wpa_driver_scan_params *
 wpa_scan_clone_params(const struct wpa_driver_scan_params *src)
 {
@@ -2286,6 +5882,10 @@ wpa_scan_clone_params(const struct wpa_driver_scan_params *src)
 	}
 
 	params->filter_rssi = src->filter_rssi;
+	params->relative_rssi_set = src->relative_rssi_set;
+	params->relative_rssi = src->relative_rssi;
+	params->relative_adjust_band = src->relative_adjust_band;
+	params->relative_adjust_rssi = src->relative_adjust_rssi;
 	params->p2p_probe = src->p2p_probe;
 	params->only_new_results = src->only_new_results;
 	params->low_priority = src->low_priority;
@@ -2336,11 +5936,145 @@ void wpa_scan_free_params(struct wpa_driver_scan_params *params)
 }
 
 
+/*
+ * PNO match set selection
+ *
+ * If more networks are enabled than the driver has match sets, offload the
+ * ones most likely to be found instead of the first ones in priority order:
+ * recently and often associated networks and networks seen recently according
+ * to the channel history, i.e., in the current location. Priority breaks
+ * ties. The selection is re-evaluated periodically while PNO is running.
+ */
+#define WPAS_PNO_MATCH_REFRESH (15 * 60)
+#define WPAS_PNO_NEARBY_AGE (10 * 60)
+
+static int wpas_pno_score(struct wpas_chan_hist *hist, struct wpa_ssid *ssid,
+			  os_time_t now)
+{
+	struct wpas_chan_hist_entry *e;
+	os_time_t age;
+	int score = 0;
+
+	e = hist ? wpas_chan_hist_find(hist, ssid->ssid, ssid->ssid_len) : NULL;
+	if (!e)
+		return 0;
+
+	/* Recency of the last association (0..100) */
+	age = now - e->last_assoc;
+	if (e->last_assoc && age >= 0 && age < WPAS_CHAN_HIST_MAX_AGE)
+		score += 100 - age * 100 / WPAS_CHAN_HIST_MAX_AGE;
+
+	/* Number of associations (0..100) */
+	score += 10 * MIN(e->num_assoc, 10);
+
+	/* Seen nearby (0..150) */
+	age = now - wpas_chan_hist_last_seen(e);
+	if (age >= 0 && age < WPAS_PNO_NEARBY_AGE)
+		score += 100;
+	if (age >= 0 && age < WPAS_CHAN_HIST_MAX_AGE)
+		score += 50 - age * 50 / WPAS_CHAN_HIST_MAX_AGE;
+
+	return score;
+}
+
+
+/*
+ * Select up to @max enabled networks for PNO matching, best first. Returns the
+ * number of networks stored in @sel and a signature of the selection in @sig,
+ * or -1 on failure.
+ */
+static int wpas_pno_select(struct wpa_supplicant *wpa_s, size_t max,
+			   struct wpa_ssid **sel, u32 *sig)
+{
+	struct wpas_chan_hist *hist;
+	struct wpa_ssid *ssid;
+	struct os_time now;
+	size_t i, pos, num = 0;
+	int *score, sc;
+
+	*sig = 2166136261U;
+	if (!max)
+		return 0;
+	score = os_calloc(max, sizeof(*score));
+	if (!score)
+		return -1;
+
+	hist = wpas_chan_hist_get(wpa_s);
+	os_get_time(&now);
+	for (ssid = wpa_s->conf->ssid; ssid; ssid = ssid->next) {
+		if (wpas_network_disabled(wpa_s, ssid) || !ssid->ssid ||
+		    !ssid->ssid_len)
+			continue;
+		sc = wpas_pno_score(hist, ssid, now.sec);
+		/* Insert into the sorted selection; ties keep list order */
+		for (pos = num; pos > 0; pos--) {
+			if (sc < score[pos - 1] ||
+			    (sc == score[pos - 1] &&
+			     ssid->priority <= sel[pos - 1]->priority))
+				break;
+		}
+		if (pos == max)
+			continue;
+		if (num < max)
+			num++;
+		for (i = num - 1; i > pos; i--) {
+			score[i] = score[i - 1];
+			sel[i] = sel[i - 1];
+		}
+		score[pos] = sc;
+		sel[pos] = ssid;
+	}
+
+	for (i = 0; i < num; i++) {
+		wpa_dbg(wpa_s, MSG_DEBUG, "PNO: Match set %u: %s (score %d)",
+			(unsigned int) i,
+			wpa_ssid_txt(sel[i]->ssid, sel[i]->ssid_len), score[i]);
+		*sig = (*sig ^ (u32) sel[i]->id) * 16777619U;
+	}
+	os_free(score);
+
+	return num;
+}
+
+
+static void wpas_pno_match_refresh(void *eloop_ctx, void *timeout_ctx)
+{
+	struct wpa_supplicant *wpa_s = eloop_ctx;
+	struct wpa_ssid **sel = NULL;
+	int num = -1;
+	u32 sig;
+
+	if (!wpa_s->pno)
+		return;
+
+	if (wpa_s->max_match_sets)
+		sel = os_calloc(wpa_s->max_match_sets, sizeof(*sel));
+	if (sel)
+		num = wpas_pno_select(wpa_s, wpa_s->max_match_sets, sel,
+				      &sig);
+	os_free(sel);
+
+	/* Keep the current selection if a new one could not be made */
+	if (num < 0 || sig == wpa_s->pno_match_sig) {
+		eloop_register_timeout(WPAS_PNO_MATCH_REFRESH, 0,
+				       wpas_pno_match_refresh, wpa_s, NULL);
+		return;
+	}
+
+	wpa_dbg(wpa_s, MSG_DEBUG, "PNO: Match set selection changed - restart");
+	wpas_stop_pno(wpa_s);
+	if (wpa_s->sched_scanning)
+		wpa_s->pno_sched_pending = 1;
+	else
+		wpas_start_pno(wpa_s);
+}
+
+
 int wpas_start_pno(struct wpa_supplicant *wpa_s)
 {
 	int ret, interval, prio;
-	size_t i, num_ssid, num_match_ssid;
-	struct wpa_ssid *ssid;
+	size_t i, num_ssid, num_match_ssid, num_sel = 0;
+	struct wpa_ssid *ssid, **sel = NULL;
 	struct wpa_driver_scan_params params;
 
 	if (!wpa_s->sched_scan_supported)
@@ -2399,17 +6133,46 @@ int wpas_start_pno(struct wpa_supplicant *wpa_s)
 	}
 
 	if (num_match_ssid > wpa_s->max_match_sets) {
+		wpa_dbg(wpa_s, MSG_DEBUG,
+			"PNO: Too many SSIDs to match - select %u of %u",
+			(unsigned int) wpa_s->max_match_sets,
+			(unsigned int) num_match_ssid);
 		num_match_ssid = wpa_s->max_match_sets;
-		wpa_dbg(wpa_s, MSG_DEBUG, "PNO: Too many SSIDs to match");
+		sel = os_calloc(num_match_ssid, sizeof(*sel));
+		if (sel == NULL)
+			return -1;
+		ret = wpas_pno_select(wpa_s, num_match_ssid, sel,
+				      &wpa_s->pno_match_sig);
+		if (ret < 0) {
+			os_free(sel);
+			return -1;
+		}
+		num_sel = ret;
 	}
 	params.filter_ssids = os_calloc(num_match_ssid,
 					sizeof(struct wpa_driver_scan_filter));
-	if (params.filter_ssids == NULL)
+	if (params.filter_ssids == NULL) {
+		os_free(sel);
 		return -1;
+	}
+
+	for (i = 0; sel && i < num_sel; i++) {
+		ssid = sel[i];
+		if (ssid->scan_ssid && params.num_ssids < num_ssid) {
+			params.ssids[params.num_ssids].ssid = ssid->ssid;
+			params.ssids[params.num_ssids].ssid_len =
+				ssid->ssid_len;
+			params.num_ssids++;
+		}
+		os_memcpy(params.filter_ssids[i].ssid, ssid->ssid,
+			  ssid->ssid_len);
+		params.filter_ssids[i].ssid_len = ssid->ssid_len;
+		params.num_filter_ssids++;
+	}
 
 	i = 0;
 	prio = 0;
-	ssid = wpa_s->conf->pssid[prio];
+	ssid = sel ? NULL : wpa_s->conf->pssid[prio];
 	while (ssid) {
 		if (!wpas_network_disabled(wpa_s, ssid)) {
 			if (ssid->scan_ssid && params.num_ssids < num_ssid) {
@@ -2437,6 +6200,7 @@ int wpas_start_pno(struct wpa_supplicant *wpa_s)
 
 	if (wpa_s->conf->filter_rssi)
 		params.filter_rssi = wpa_s->conf->filter_rssi;
+	wpa_scan_set_relative_rssi_params(wpa_s, &params);
 
 	interval = wpa_s->conf->sched_scan_interval ?
 		wpa_s->conf->sched_scan_interval : 10;
@@ -2452,10 +6216,16 @@ int wpas_start_pno(struct wpa_supplicant *wpa_s)
 
 	ret = wpa_supplicant_start_sched_scan(wpa_s, &params, interval);
 	os_free(params.filter_ssids);
-	if (ret == 0)
+	if (ret == 0) {
 		wpa_s->pno = 1;
-	else
+		if (sel)
+			eloop_register_timeout(WPAS_PNO_MATCH_REFRESH, 0,
+					       wpas_pno_match_refresh, wpa_s,
+					       NULL);
+	} else {
 		wpa_msg(wpa_s, MSG_ERROR, "Failed to schedule PNO");
+	}
+	os_free(sel);
 	return ret;
 }
 
@@ -2467,6 +6237,7 @@ int wpas_stop_pno(struct wpa_supplicant *wpa_s)
 	if (!wpa_s->pno)
 		return 0;
 
+	eloop_cancel_timeout(wpas_pno_match_refresh, wpa_s, NULL);
 	ret = wpa_supplicant_stop_sched_scan(wpa_s);
 	wpa_s->sched_scan_stop_req = 1;
 
@@ -2536,3 +6307,26 @@ int wpas_mac_addr_rand_scan_set(struct wpa_supplicant *wpa_s,
 	wpa_s->mac_addr_rand_enable |= type;
 	return 0;
 }
+
+
+/**
+ * wpas_scan_deinit - Free scan state of an interface
+ * @wpa_s: Pointer to wpa_supplicant data
+ *
+ * This function is called when the interface is being removed to save the
+ * channel history and to free state allocated by the scan module.
+ */
+void wpas_scan_deinit(struct wpa_supplicant *wpa_s)
+{
+	wpas_chan_hist_deinit(wpa_s);
+	eloop_cancel_timeout(wpas_pno_match_refresh, wpa_s, NULL);
+	os_free(wpa_s->scan_stats);
+	wpa_s->scan_stats = NULL;
+	os_free(wpa_s->chan_stats);
+	wpa_s->chan_stats = NULL;
+	os_free(wpa_s->adaptive_scan);
+	wpa_s->adaptive_scan = NULL;
+	os_free(wpa_s->scan_merge);
+	wpa_s->scan_merge = NULL;
+	wpas_scan_delta_deinit(wpa_s);
+}
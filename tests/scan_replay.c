@@ -0,0 +1,453 @@
+/*
+ * Offline scan result replay benchmark
+ *
+ * This software may be distributed under the terms of the BSD license.
+ * See README for more details.
+ *
+ * Load scan results from a text dump and feed them through a stub driver to
+ * wpa_supplicant_get_scan_results(), i.e., the same post-processing
+ * (filtering, SNR and throughput estimation, sorting) and BSS table update as
+ * results fetched from a real driver, to measure its cost without hardware.
+ * Each iteration times two fetches of a fresh copy of the results: one with
+ * new_scan=0, which runs only the post-processing and the BSS table update,
+ * and one with new_scan=1, which also runs the bookkeeping of an own scan
+ * (channel history and statistics, adaptive interval, chunked scans and so
+ * on). The difference is reported as the cost of that bookkeeping.
+ * Each line of the dump, other than empty lines and comments starting with
+ * '#', describes one BSS:
+ *
+ * <BSSID> <freq> <level> <noise> <flags> [hex IEs]
+ *
+ * with level and noise in dBm and flags as in struct wpa_scan_res, e.g.,
+ * 02:00:00:00:01:01 5180 -52 -95 0x0b 00047465737401088c129824b048606c
+ *
+ * The program is linked with the wpa_supplicant objects (without main.o).
+ * With CONFIG_SCAN_ALLOC_TRACE, the number of allocations per scan cycle is
+ * reported, too.
+ *
+ * With -c, a reconnection to the open network <SSID> after resume is
+ * simulated once the timing runs are done: a full scan with the network
+ * configured, then a flush of the BSS table (the channel history is kept)
+ * and the two-phase connect scan. Each scanned channel is assumed to take
+ * REPLAY_DWELL_MS and only the dump entries on scanned channels are returned.
+ * The reported time_to_associate_ms is the scan time until the network was
+ * found; the association exchange itself is the same for both phases and is
+ * not included.
+ *
+ * Usage: scan_replay [-c <SSID>] <dump file> [iterations]
+ *
+ * scan_replay.txt is a small sample dump, see "make run-scan-replay".
+ */
+
+#include "utils/includes.h"
+
+#include "utils/common.h"
+#include "utils/eloop.h"
+#include "config.h"
+#include "wpa_supplicant_i.h"
+#include "driver_i.h"
+#include "bss.h"
+#include "scan.h"
+
+
+/* scan.c functions used here that scan.h does not declare */
+int * wpas_connect_scan_predict_freqs(struct wpa_supplicant *wpa_s);
+int wpas_scan_alloc_trace(struct wpa_supplicant *wpa_s, char *buf,
+			  size_t buflen);
+void wpas_scan_deinit(struct wpa_supplicant *wpa_s);
+
+
+/* Maximum line length in a scan result dump */
+#define REPLAY_LINE_LEN 8192
+/* Assumed scan time per channel in the connect simulation (ms) */
+#define REPLAY_DWELL_MS 50
+
+struct replay_drv {
+	/* Results returned by the next get_scan_results2() call */
+	struct wpa_scan_results *next;
+};
+
+
+static struct wpa_scan_results * replay_get_scan_results2(void *priv)
+{
+	struct replay_drv *drv = priv;
+	struct wpa_scan_results *res = drv->next;
+
+	drv->next = NULL;
+	return res;
+}
+
+
+static const struct wpa_driver_ops replay_driver_ops = {
+	.name = "replay",
+	.desc = "Scan result replay stub driver",
+	.get_scan_results2 = replay_get_scan_results2,
+};
+
+
+static struct wpa_scan_res * replay_parse(char *line)
+{
+	struct wpa_scan_res *r;
+	char *field[6], *pos = line;
+	size_t ie_len;
+	int i;
+
+	for (i = 0; i < 6; i++) {
+		while (*pos == ' ' || *pos == '\t')
+			pos++;
+		field[i] = pos;
+		while (*pos && *pos != ' ' && *pos != '\t' && *pos != '\n' &&
+		       *pos != '\r')
+			pos++;
+		if (*pos)
+			*pos++ = '\0';
+		if (*field[i] == '\0' && i < 5)
+			return NULL;
+	}
+
+	ie_len = os_strlen(field[5]) / 2;
+	if (os_strlen(field[5]) & 1)
+		return NULL;
+	r = os_zalloc(sizeof(*r) + ie_len);
+	if (!r)
+		return NULL;
+	if (hwaddr_aton(field[0], r->bssid) < 0 ||
+	    hexstr2bin(field[5], (u8 *) (r + 1), ie_len) < 0) {
+		os_free(r);
+		return NULL;
+	}
+	r->freq = atoi(field[1]);
+	r->level = atoi(field[2]);
+	r->noise = atoi(field[3]);
+	r->flags = strtoul(field[4], NULL, 0);
+	r->ie_len = ie_len;
+
+	return r;
+}
+
+
+static struct wpa_scan_results * replay_load(const char *fname)
+{
+	struct wpa_scan_results *res;
+	struct wpa_scan_res *r, **n;
+	char *buf;
+	FILE *f;
+	int line = 0;
+
+	f = fopen(fname, "r");
+	if (!f) {
+		wpa_printf(MSG_ERROR, "Could not open '%s'", fname);
+		return NULL;
+	}
+
+	buf = os_malloc(REPLAY_LINE_LEN);
+	res = os_zalloc(sizeof(*res));
+	if (!buf || !res)
+		goto fail;
+
+	while (fgets(buf, REPLAY_LINE_LEN, f)) {
+		line++;
+		if (buf[0] == '#' || buf[0] == '\n' || buf[0] == '\0')
+			continue;
+		r = replay_parse(buf);
+		if (!r) {
+			wpa_printf(MSG_INFO, "Invalid entry on line %d", line);
+			continue;
+		}
+		n = os_realloc_array(res->res, res->num + 1, sizeof(*n));
+		if (!n) {
+			os_free(r);
+			goto fail;
+		}
+		res->res = n;
+		res->res[res->num++] = r;
+	}
+
+	fclose(f);
+	os_free(buf);
+	return res;
+
+fail:
+	fclose(f);
+	os_free(buf);
+	wpa_scan_results_free(res);
+	return NULL;
+}
+
+
+/* Copy the results on the given channels (all if freqs is %NULL) */
+static struct wpa_scan_results *
+replay_copy(const struct wpa_scan_results *src, const int *freqs)
+{
+	struct wpa_scan_results *res;
+	size_t i;
+
+	res = os_zalloc(sizeof(*res));
+	if (!res)
+		return NULL;
+	res->res = os_calloc(src->num, sizeof(*res->res));
+	if (!res->res && src->num) {
+		os_free(res);
+		return NULL;
+	}
+	for (i = 0; i < src->num; i++) {
+		if (freqs && !int_array_includes(freqs, src->res[i]->freq))
+			continue;
+		res->res[res->num] = os_memdup(src->res[i],
+					       sizeof(struct wpa_scan_res) +
+					       src->res[i]->ie_len +
+					       src->res[i]->beacon_ie_len);
+		if (!res->res[res->num]) {
+			wpa_scan_results_free(res);
+			return NULL;
+		}
+		res->num++;
+	}
+	os_get_reltime(&res->fetch_time);
+
+	return res;
+}
+
+
+/*
+ * Fetch a copy of all results through the stub driver and add the time spent
+ * in wpa_supplicant_get_scan_results() to @us; the copy is not timed. Returns
+ * the number of results kept or -1 on failure.
+ */
+static int replay_timed(struct wpa_supplicant *wpa_s, struct replay_drv *drv,
+			const struct wpa_scan_results *tmpl, int new_scan,
+			unsigned long long *us)
+{
+	struct wpa_scan_results *res;
+	struct os_reltime start, end, diff;
+	int kept;
+
+	drv->next = replay_copy(tmpl, NULL);
+	if (!drv->next)
+		return -1;
+	os_get_reltime(&start);
+	res = wpa_supplicant_get_scan_results(wpa_s, NULL, new_scan);
+	os_get_reltime(&end);
+	if (!res)
+		return -1;
+	os_reltime_sub(&end, &start, &diff);
+	*us += diff.sec * 1000000ULL + diff.usec;
+	kept = res->num;
+	wpa_scan_results_free(res);
+
+	return kept;
+}
+
+
+/*
+ * Scan the given channels (all if freqs is %NULL) through the stub driver.
+ * Returns 1 if the SSID was found, 0 if not or -1 on failure.
+ */
+static int replay_scan_for(struct wpa_supplicant *wpa_s,
+			   struct replay_drv *drv,
+			   const struct wpa_scan_results *tmpl,
+			   const int *freqs, const char *ssid)
+{
+	struct wpa_scan_results *res;
+	const u8 *ie;
+	size_t i, ssid_len = os_strlen(ssid);
+	int found = 0;
+
+	drv->next = replay_copy(tmpl, freqs);
+	if (!drv->next)
+		return -1;
+	res = wpa_supplicant_get_scan_results(wpa_s, NULL, 1);
+	if (!res)
+		return -1;
+	for (i = 0; i < res->num && !found; i++) {
+		ie = wpa_scan_get_ie(res->res[i], WLAN_EID_SSID);
+		found = ie && ie[1] == ssid_len &&
+			os_memcmp(ie + 2, ssid, ssid_len) == 0;
+	}
+	wpa_scan_results_free(res);
+
+	return found;
+}
+
+
+/* Simulate a reconnection after resume, see the comment at the top */
+static int replay_connect(struct wpa_supplicant *wpa_s,
+			  struct replay_drv *drv,
+			  const struct wpa_scan_results *tmpl,
+			  const char *ssid)
+{
+	struct wpa_ssid *net;
+	int *freqs = NULL, *all = NULL;
+	unsigned int ms = 0, full_ms;
+	size_t i;
+	int found = 0, phase = 1;
+
+	net = wpa_config_add_network(wpa_s->conf);
+	if (!net)
+		return -1;
+	wpa_config_set_network_defaults(net);
+	net->key_mgmt = WPA_KEY_MGMT_NONE;
+	net->ssid = (u8 *) os_strdup(ssid);
+	if (!net->ssid)
+		return -1;
+	net->ssid_len = os_strlen(ssid);
+
+	for (i = 0; i < tmpl->num; i++)
+		int_array_add_unique(&all, tmpl->res[i]->freq);
+	full_ms = int_array_len(all) * REPLAY_DWELL_MS;
+	os_free(all);
+
+	/* Before the suspend: a full scan finds the network */
+	if (replay_scan_for(wpa_s, drv, tmpl, NULL, ssid) < 0)
+		return -1;
+
+	/* After resume: the BSS table is gone, the channel history is not */
+	wpa_bss_flush(wpa_s);
+	freqs = wpas_connect_scan_predict_freqs(wpa_s);
+	if (freqs) {
+		ms += int_array_len(freqs) * REPLAY_DWELL_MS;
+		found = replay_scan_for(wpa_s, drv, tmpl, freqs, ssid);
+		os_free(freqs);
+	}
+	if (found == 0) {
+		phase = 2;
+		ms += full_ms;
+		found = replay_scan_for(wpa_s, drv, tmpl, NULL, ssid);
+	}
+	if (found < 0)
+		return -1;
+
+	printf("connect_found=%d\n"
+	       "connect_phase=%d\n"
+	       "time_to_associate_ms=%u\n"
+	       "full_scan_ms=%u\n",
+	       found, phase, ms, full_ms);
+	return 0;
+}
+
+
+#ifdef CONFIG_SCAN_ALLOC_TRACE
+/* Number of allocations in the last completed scan cycle */
+static unsigned int replay_cycle_allocs(struct wpa_supplicant *wpa_s)
+{
+	char buf[4096], *pos;
+	unsigned int count = 0;
+
+	if (wpas_scan_alloc_trace(wpa_s, buf, sizeof(buf)) < 0)
+		return 0;
+	buf[sizeof(buf) - 1] = '\0';
+	pos = os_strstr(buf, "\ncount=");
+	if (pos)
+		count = atoi(pos + 7);
+	return count;
+}
+#endif /* CONFIG_SCAN_ALLOC_TRACE */
+
+
+static void usage(void)
+{
+	printf("usage: scan_replay [-c <SSID>] <dump file> [iterations]\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct wpa_supplicant wpa_s;
+	struct replay_drv drv;
+	struct wpa_scan_results *tmpl;
+	unsigned long long process_us = 0, cycle_us = 0, ns = 0, cycle_ns = 0;
+	unsigned int i, iterations = 1, done = 0, allocs = 0;
+	const char *connect_ssid = NULL;
+	int c, n, kept = 0, ret = -1;
+
+	while ((c = getopt(argc, argv, "c:")) > 0) {
+		switch (c) {
+		case 'c':
+			connect_ssid = optarg;
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+	if (optind >= argc) {
+		usage();
+		return -1;
+	}
+	if (optind + 1 < argc)
+		iterations = atoi(argv[optind + 1]);
+	if (iterations == 0)
+		iterations = 1;
+
+	if (os_program_init())
+		return -1;
+	wpa_debug_level = MSG_INFO;
+	if (eloop_init()) {
+		wpa_printf(MSG_ERROR, "Failed to initialize event loop");
+		goto fail_prog;
+	}
+
+	os_memset(&drv, 0, sizeof(drv));
+	os_memset(&wpa_s, 0, sizeof(wpa_s));
+	os_strlcpy(wpa_s.ifname, "replay0", sizeof(wpa_s.ifname));
+	wpa_s.driver = &replay_driver_ops;
+	wpa_s.drv_priv = &drv;
+	wpa_s.conf = wpa_config_alloc_empty(NULL, NULL);
+	if (!wpa_s.conf || wpa_bss_init(&wpa_s) < 0)
+		goto fail;
+
+	tmpl = replay_load(argv[optind]);
+	if (!tmpl)
+		goto fail_bss;
+
+	for (i = 0; i < iterations; i++) {
+		if (replay_timed(&wpa_s, &drv, tmpl, 0, &process_us) < 0)
+			break;
+		n = replay_timed(&wpa_s, &drv, tmpl, 1, &cycle_us);
+		if (n < 0)
+			break;
+		kept = n;
+#ifdef CONFIG_SCAN_ALLOC_TRACE
+		allocs += replay_cycle_allocs(&wpa_s);
+#endif /* CONFIG_SCAN_ALLOC_TRACE */
+		done++;
+	}
+	wpa_scan_results_free(drv.next);
+
+	if (done && tmpl->num) {
+		ns = process_us * 1000 /
+			((unsigned long long) done * tmpl->num);
+		cycle_ns = cycle_us * 1000 /
+			((unsigned long long) done * tmpl->num);
+	}
+	printf("results=%u\n"
+	       "kept=%d\n"
+	       "iterations=%u\n"
+	       "process_us=%llu\n"
+	       "ns_per_result=%llu\n"
+	       "scan_cycle_us=%llu\n"
+	       "scan_cycle_ns_per_result=%llu\n"
+	       "bookkeeping_us=%llu\n",
+	       (unsigned int) tmpl->num, kept, done,
+	       process_us, ns, cycle_us, cycle_ns,
+	       cycle_us > process_us ? cycle_us - process_us : 0);
+#ifdef CONFIG_SCAN_ALLOC_TRACE
+	printf("allocs_per_iteration=%u\n", done ? allocs / done : 0);
+#endif /* CONFIG_SCAN_ALLOC_TRACE */
+	ret = done == iterations ? 0 : -1;
+	if (ret == 0 && connect_ssid &&
+	    replay_connect(&wpa_s, &drv, tmpl, connect_ssid) < 0)
+		ret = -1;
+	wpa_scan_results_free(tmpl);
+
+fail_bss:
+	wpas_scan_deinit(&wpa_s);
+	wpa_bss_deinit(&wpa_s);
+fail:
+	if (wpa_s.conf)
+		wpa_config_free(wpa_s.conf);
+	eloop_destroy();
+fail_prog:
+	os_program_deinit();
+	return ret;
+}